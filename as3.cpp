@@ -8,10 +8,25 @@
 
 
 #include <vector>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -28,6 +43,9 @@
 #endif
 
 #include "glm/glm.hpp"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include <time.h>
 #include <math.h>
 
@@ -60,11 +78,36 @@ public:
     Curve() {}
 };
 
+// The 16 control points of a bicubic patch stored once, cp[4*i+j] is point j
+// of row i. Row i is the u curve given on line i of the patch in the file,
+// column j is the v curve through point j of every row
 class Patch {
 public:
-    Curve v0, v1, v2, v3, u0, u1, u2, u3;
+    vec3 cp[16];
     Patch() {}
-    Patch(Curve v0, Curve v1, Curve v2, Curve v3, Curve u0, Curve u1, Curve u2, Curve u3) {Patch::v0 = v0; Patch::v1 = v1; Patch::v2 = v2; Patch::v3 = v3; Patch::u0 = u0; Patch::u1 = u1; Patch::u2 = u2; Patch::u3 = u3;}
+    const vec3& at(int i, int j) const { return cp[4*i+j]; }
+    Curve row(int i) const { return Curve(cp[4*i], cp[4*i+1], cp[4*i+2], cp[4*i+3]); }
+    Curve column(int j) const { return Curve(cp[j], cp[4+j], cp[8+j], cp[12+j]); }
+};
+
+class Vertex {
+public:
+    vec3 point, normal;
+    Vertex(vec3 point, vec3 normal) {Vertex::point = point; Vertex::normal = normal;}
+    Vertex() {}
+};
+
+// Indexed triangle mesh, interleaved position/normal vertices
+// and three 32 bit indices per triangle
+class Mesh {
+public:
+    vector<Vertex> vertices;
+    vector<GLuint> indices;
+    int triangleCount() const { return indices.size() / 3; }
+    void swap(Mesh& other) {
+        vertices.swap(other.vertices);
+        indices.swap(other.indices);
+    }
 };
 
 
@@ -76,10 +119,17 @@ Viewport viewport;
 vector<Patch> patches;
 int bezStep; // change where this gets set
 int patchSize; // set this in the parser
-bool adaptive;
+enum TessMode { TESS_UNIFORM, TESS_ADAPTIVE, TESS_FLAT, TESS_BUDGET, TESS_RATE };
+// -u, -a (midpoint tests), -f (control net flatness), -b (flatness under a
+// budget) or -p (grid steps per patch from the control net)
+TessMode tessMode;
 bool lines=true;
 bool smooth=true;
 float tolerance;
+bool headless=false; // tessellate and write the mesh without ever touching GL/GLUT
+string outFile; // mesh output path for headless mode, empty means just report
+bool verify=false; // check the grid engines against bezpatchinterp and exit
+atomic<bool> abandonJobs(false); // set at exit, a running tessellation skips what is left
 
 // angle of rotation for the object
 float angleX = 0.0, angleY = 0, transX = 0, transY = 0;
@@ -87,6 +137,8 @@ float angleX = 0.0, angleY = 0, transX = 0, transY = 0;
 float lx=0.0f,lz=-1.0f;
 // XZ position of the camera
 float x=0.0f,z=11.0f;
+// the perspective myReshape sets up
+const float fieldOfView = 45, nearPlane = 1, farPlane = 100;
 GLfloat light_position[4] = {0,0,-1,0}, light_ambient[4] = {0.0, 0.0, 0.0, 1.0}, light_diffuse[4] = {1.0, 1.0, 1.0, 1.0}, light_specular[4] = {1.0, 1.0, 1.0, 1.0};
 float mcolor[] = { 1.0f, 0.5f, 0.0f, 1.0f };
 //float zcolor[]= { 0.0f, 1.0f, 0.0f, 1.0f };
@@ -133,7 +185,7 @@ void myReshape(int w, int h) {
 	glViewport(0, 0, viewport.w, viewport.h);
     
 	// Set the correct perspective.
-	gluPerspective(45,ratio,1,100);
+	gluPerspective(fieldOfView,ratio,nearPlane,farPlane);
     
     
 	// Get Back to the Modelview
@@ -175,412 +227,2924 @@ void bezcurveinterp(Curve curve, float u, vec3& point, vec3& dPdu) {
 // Given a control patch and (u,v) values,
 // find the surface point and normal
 //***************************************************
-void bezpatchinterp(Patch patch, float u, float v, vec3& point, vec3& normal) {
+void bezpatchpartials(const Patch& patch, float u, float v, vec3& point, vec3& dPdu, vec3& dPdv) {
     Curve vcurve, ucurve;
-    vec3 p, dPdv, dPdu;
     
     
     //build control points for a Bezier curve in v
-    bezcurveinterp(patch.u0, u, (vcurve.p0), dPdv);
-    bezcurveinterp(patch.u1, u, (vcurve.p1), dPdv);
-    bezcurveinterp(patch.u2, u, (vcurve.p2), dPdv);
-    bezcurveinterp(patch.u3, u, (vcurve.p3), dPdv);
+    bezcurveinterp(patch.row(0), u, (vcurve.p0), dPdv);
+    bezcurveinterp(patch.row(1), u, (vcurve.p1), dPdv);
+    bezcurveinterp(patch.row(2), u, (vcurve.p2), dPdv);
+    bezcurveinterp(patch.row(3), u, (vcurve.p3), dPdv);
 
     
     //build control points for a Bezier curve in u
-    bezcurveinterp(patch.v0, v, (ucurve.p0), dPdu);
-    bezcurveinterp(patch.v1, v, (ucurve.p1), dPdu);
-    bezcurveinterp(patch.v2, v, (ucurve.p2), dPdu);
-    bezcurveinterp(patch.v3, v, (ucurve.p3), dPdu);
+    bezcurveinterp(patch.column(0), v, (ucurve.p0), dPdu);
+    bezcurveinterp(patch.column(1), v, (ucurve.p1), dPdu);
+    bezcurveinterp(patch.column(2), v, (ucurve.p2), dPdu);
+    bezcurveinterp(patch.column(3), v, (ucurve.p3), dPdu);
     
     //evaluate surface and derivative for u and v
     bezcurveinterp(vcurve, v, point, dPdv);
     bezcurveinterp(ucurve, u, point, dPdu);
-    
+}
+
+void bezpatchinterp(const Patch& patch, float u, float v, vec3& point, vec3& normal) {
+    vec3 dPdv, dPdu;
+    bezpatchpartials(patch, u, v, point, dPdu, dPdv);
     normal=normalize(cross(dPdu,dPdv));
 }
 
-void adaptiveTes(vec3 firstpoint, vec3 secondpoint, vec3 thirdpoint, vec3 firstnormal, vec3 secondnormal, vec3 thirdnormal, float u1, float v1, float u2, float v2, float u3, float v3, Patch patch, int recursion){
-    vec3 point1, point2, point3, normal1, normal2, normal3;
-    vec3 midpoint1((firstpoint.x+secondpoint.x)/2,(firstpoint.y+secondpoint.y)/2,(firstpoint.z+secondpoint.z)/2);
-    bezpatchinterp(patch, (u1+u2)/2, (v1+v2)/2, point1, normal1);
-    
-    vec3 midpoint2((secondpoint.x+thirdpoint.x)/2,(secondpoint.y+thirdpoint.y)/2,(secondpoint.z+thirdpoint.z)/2);
-    bezpatchinterp(patch, (u2+u3)/2, (v2+v3)/2, point2, normal2);
-    
-    vec3 midpoint3((thirdpoint.x+firstpoint.x)/2,(thirdpoint.y+firstpoint.y)/2,(thirdpoint.z+firstpoint.z)/2);
-    bezpatchinterp(patch, (u3+u1)/2, (v3+v1)/2, point3, normal3);
-    
-    float diff1=sqrt(sqr(point1.x-midpoint1.x)+sqr(point1.y-midpoint1.y)+sqr(point1.z-midpoint1.z));
-    float diff2=sqrt(sqr(point2.x-midpoint2.x)+sqr(point2.y-midpoint2.y)+sqr(point2.z-midpoint2.z));
-    float diff3=sqrt(sqr(point3.x-midpoint3.x)+sqr(point3.y-midpoint3.y)+sqr(point3.z-midpoint3.z));
-    
-    // case when all sides are close enough
-    if ((diff1<tolerance && diff2<tolerance && diff3<tolerance) || recursion==0){
-        if (lines){
-            glNormal3f(firstnormal.x, firstnormal.y, firstnormal.z);
-            glVertex3f(firstpoint.x, firstpoint.y, firstpoint.z);
-            glNormal3f(secondnormal.x, secondnormal.y, secondnormal.z);
-            glVertex3f(secondpoint.x, secondpoint.y, secondpoint.z);
-            
-            glNormal3f(secondnormal.x, secondnormal.y, secondnormal.z);
-            glVertex3f(secondpoint.x, secondpoint.y, secondpoint.z);
-            glNormal3f(thirdnormal.x, thirdnormal.y, thirdnormal.z);
-            glVertex3f(thirdpoint.x, thirdpoint.y, thirdpoint.z);
-            
-            glNormal3f(thirdnormal.x, thirdnormal.y, thirdnormal.z);
-            glVertex3f(thirdpoint.x, thirdpoint.y, thirdpoint.z);
-            glNormal3f(firstnormal.x, firstnormal.y, firstnormal.z);
-            glVertex3f(firstpoint.x, firstpoint.y, firstpoint.z);
-        } else {
-            glNormal3f(firstnormal.x, firstnormal.y, firstnormal.z);
-            glVertex3f(firstpoint.x, firstpoint.y, firstpoint.z);
-            glNormal3f(secondnormal.x, secondnormal.y, secondnormal.z);
-            glVertex3f(secondpoint.x, secondpoint.y, secondpoint.z);
-            glNormal3f(thirdnormal.x, thirdnormal.y, thirdnormal.z);
-            glVertex3f(thirdpoint.x, thirdpoint.y, thirdpoint.z);
-        }
-    } else if (diff1>=tolerance && diff2<tolerance && diff3<tolerance){
-        adaptiveTes(firstpoint, point1, thirdpoint, firstnormal, normal1, thirdnormal, u1, v1, (u1+u2)/2, (v1+v2)/2, u3, v3, patch, recursion-1);
-        adaptiveTes(point1, secondpoint, thirdpoint, normal1, secondnormal, thirdnormal, (u1+u2)/2, (v1+v2)/2, u2, v2, u3, v3, patch, recursion-1);
-    
-    } else if (diff1<tolerance && diff2>=tolerance && diff3<tolerance){
-        adaptiveTes(firstpoint, secondpoint, point2, firstnormal, secondnormal, normal2, u1, v1, u2, v2, (u2+u3)/2, (v2+v3)/2, patch, recursion-1);
-        adaptiveTes(firstpoint, point2, thirdpoint, firstnormal, normal2, thirdnormal, u1, v1, (u2+u3)/2, (v2+v3)/2, u3, v3, patch, recursion-1);
-    
-    } else if (diff1<tolerance && diff2<tolerance && diff3>=tolerance){
-        adaptiveTes(firstpoint, secondpoint, point3, firstnormal, secondnormal, normal3, u1, v1, u2, v2, (u3+u1)/2, (v3+v1)/2, patch, recursion-1);
-        adaptiveTes(point3, secondpoint, thirdpoint, normal3, secondnormal, thirdnormal, (u3+u1)/2, (v3+v1)/2, u2, v2, u3, v3, patch, recursion-1);
-    
-    } else if (diff1>=tolerance && diff2>=tolerance && diff3<tolerance){
-        adaptiveTes(firstpoint, point1, thirdpoint, firstnormal, normal1, thirdnormal, u1, v1, (u1+u2)/2, (v1+v2)/2, u3, v3, patch, recursion-1);
-        adaptiveTes(point1, point2, thirdpoint, normal1, normal2, thirdnormal, (u1+u2)/2, (v1+v2)/2, (u2+u3)/2, (v2+v3)/2, u3, v3, patch, recursion-1);
-        adaptiveTes(point1, secondpoint, point2, normal1, secondnormal, normal2, (u1+u2)/2, (v1+v2)/2, u2, v2, (u2+u3)/2, (v2+v3)/2, patch, recursion-1);
-    
-    } else if (diff1>=tolerance && diff2<tolerance && diff3>=tolerance){
-        adaptiveTes(firstpoint, point1, point3, firstnormal, normal1, normal3, u1, v1, (u1+u2)/2, (v1+v2)/2, (u3+u1)/2, (v3+v1)/2, patch, recursion-1);
-        adaptiveTes(point3, point1, thirdpoint, normal3, normal1, thirdnormal, (u3+u1)/2, (v3+v1)/2, (u1+u2)/2, (v1+v2)/2, u3, v3, patch, recursion-1);
-        adaptiveTes(point1, secondpoint, thirdpoint, normal1, secondnormal, thirdnormal, (u1+u2)/2, (v1+v2)/2, u2, v2, u3, v3, patch, recursion-1);
-    
-    } else if (diff1<tolerance && diff2>=tolerance && diff3>=tolerance){
-        adaptiveTes(firstpoint, point2, point3, firstnormal, normal2, normal3, u1, v1, (u2+u3)/2, (v2+v3)/2, (u3+u1)/2, (v3+v1)/2, patch, recursion-1);
-        adaptiveTes(firstpoint, secondpoint, point2, firstnormal, secondnormal, normal2, u1, v1, u2, v2, (u2+u3)/2, (v2+v3)/2, patch, recursion-1);
-        adaptiveTes(point3, point2, thirdpoint, normal3, normal2, thirdnormal, (u3+u1)/2, (v3+v1)/2, (u2+u3)/2, (v2+v3)/2, u3, v3, patch, recursion-1);
-    
-    } else {
-        adaptiveTes(firstpoint, point1, point3, firstnormal, normal1, normal3, u1, v1, (u1+u2)/2, (v1+v2)/2, (u3+u1)/2, (v3+v1)/2, patch, recursion-1);
-        adaptiveTes(point1, secondpoint, point2, normal1, secondnormal, normal2, (u1+u2)/2, (v1+v2)/2, u2, v2, (u2+u3)/2, (v2+v3)/2, patch, recursion-1);
-        adaptiveTes(point3, point1, point2, normal3, normal1, normal2, (u3+u1)/2, (v3+v1)/2, (u1+u2)/2, (v1+v2)/2, (u2+u3)/2, (v2+v3)/2, patch, recursion-1);
-        adaptiveTes(point3, point2, thirdpoint, normal3, normal2, thirdnormal, (u3+u1)/2, (v3+v1)/2, (u2+u3)/2, (v2+v3)/2, u3, v3, patch, recursion-1);
+//****************************************************
+// Lanes of floats for the batch evaluator, 8 wide with
+// AVX, 4 wide with SSE2 and plain scalar otherwise
+//***************************************************
+#if defined(__AVX__)
+class Lanes {
+public:
+    enum { WIDTH = 8 };
+    __m256 v;
+    Lanes() {}
+    Lanes(__m256 v) : v(v) {}
+    Lanes(float f) : v(_mm256_set1_ps(f)) {}
+    static Lanes load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+    Lanes operator+(Lanes b) const { return _mm256_add_ps(v, b.v); }
+    Lanes operator-(Lanes b) const { return _mm256_sub_ps(v, b.v); }
+    Lanes operator*(Lanes b) const { return _mm256_mul_ps(v, b.v); }
+    Lanes operator/(Lanes b) const { return _mm256_div_ps(v, b.v); }
+    friend Lanes sqrt(Lanes a) { return _mm256_sqrt_ps(a.v); }
+};
+#elif defined(__SSE2__)
+class Lanes {
+public:
+    enum { WIDTH = 4 };
+    __m128 v;
+    Lanes() {}
+    Lanes(__m128 v) : v(v) {}
+    Lanes(float f) : v(_mm_set1_ps(f)) {}
+    static Lanes load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+    Lanes operator+(Lanes b) const { return _mm_add_ps(v, b.v); }
+    Lanes operator-(Lanes b) const { return _mm_sub_ps(v, b.v); }
+    Lanes operator*(Lanes b) const { return _mm_mul_ps(v, b.v); }
+    Lanes operator/(Lanes b) const { return _mm_div_ps(v, b.v); }
+    friend Lanes sqrt(Lanes a) { return _mm_sqrt_ps(a.v); }
+};
+#else
+class Lanes {
+public:
+    enum { WIDTH = 1 };
+    float v;
+    Lanes() {}
+    Lanes(float f) : v(f) {}
+    static Lanes load(const float* p) { return *p; }
+    void store(float* p) const { *p = v; }
+    Lanes operator+(Lanes b) const { return v + b.v; }
+    Lanes operator-(Lanes b) const { return v - b.v; }
+    Lanes operator*(Lanes b) const { return v * b.v; }
+    Lanes operator/(Lanes b) const { return v / b.v; }
+    friend Lanes sqrt(Lanes a) { return std::sqrt(a.v); }
+};
+#endif
+
+// Structure of arrays copy of the control points, same 4*i+j order as Patch
+class PatchSoA {
+public:
+    float x[16], y[16], z[16];
+    PatchSoA(const Patch& patch) {
+        for (int k = 0; k < 16; k++) {
+            x[k] = patch.cp[k].x;
+            y[k] = patch.cp[k].y;
+            z[k] = patch.cp[k].z;
+        }
+    }
+};
+
+// cubic Bernstein weights and their derivatives at t, one parameter per lane
+inline void bernstein(Lanes t, Lanes B[4], Lanes dB[4]) {
+    Lanes s = Lanes(1.0f) - t;
+    Lanes three(3.0f), six(6.0f);
+    B[0] = s*s*s;
+    B[1] = three*t*s*s;
+    B[2] = three*t*t*s;
+    B[3] = t*t*t;
+    dB[0] = Lanes(0.0f) - three*s*s;
+    dB[1] = three*s*s - six*t*s;
+    dB[2] = six*t*s - three*t*t;
+    dB[3] = three*t*t;
+}
+
+// evaluates one coordinate of the tensor product surface and its two partials
+inline void tensorEval(const float* c, const Lanes Bu[4], const Lanes dBu[4], const Lanes Bv[4], const Lanes dBv[4],
+                       Lanes& p, Lanes& pu, Lanes& pv) {
+    p = Lanes(0.0f); pu = Lanes(0.0f); pv = Lanes(0.0f);
+    for (int i = 0; i < 4; i++) {
+        // curve in u for row i, and its derivative
+        Lanes r  = Bu[0]*Lanes(c[4*i])  + Bu[1]*Lanes(c[4*i+1])  + Bu[2]*Lanes(c[4*i+2])  + Bu[3]*Lanes(c[4*i+3]);
+        Lanes ru = dBu[0]*Lanes(c[4*i]) + dBu[1]*Lanes(c[4*i+1]) + dBu[2]*Lanes(c[4*i+2]) + dBu[3]*Lanes(c[4*i+3]);
+        p  = p  + Bv[i]*r;
+        pu = pu + Bv[i]*ru;
+        pv = pv + dBv[i]*r;
     }
-    
 }
 
 //****************************************************
-// given a patch, perform uniform subdivision compute how
-// many subdivisions there are for this step size
+// Batch version of bezpatchinterp: evaluates n (u,v)
+// pairs of one patch a full SIMD register at a time and
+// returns positions and normals as structure of arrays
 //***************************************************
-void subdividepatch(Patch patch, int step) {
-    // make sure for loops hit iu = 1 and iv = 1
-    float numdiv = ((1 + epsilon) / step);
-    vec3 point, normal;
-    float iu,iv;
-    int u = 0,v = 0;
-    vector<vector<vec3 > > points;
-    vector<vector<vec3 > > normals;
-    
-    points.resize(step+1);
-    normals.resize(step+1);
-    for(int s = 0; s < step+1; ++s)
-    {
-        //Grow Columns by step
-        points[s].resize(step+1);
-        normals[s].resize(step+1);
-    }
-    
-    //for each parametric value of iu
-    for (iv = 0; iv <= 1; iv += numdiv) {
-        //for each parametric value of iv
-        for (iu = 0; iu <= 1; iu += numdiv) {
-            
-            //evaluate surface
-            bezpatchinterp(patch, iu, iv, point, normal);
-            
-            points[v][u]=point;
-            normals[v][u]=normal;
-            u++;
+void bezpatchinterpBatch(const PatchSoA& patch, const float* u, const float* v, int n,
+                         float* px, float* py, float* pz, float* nx, float* ny, float* nz) {
+    const int W = Lanes::WIDTH;
+    for (int i = 0; i < n; i += W) {
+        // pad the last partial block through a scratch buffer
+        int count = n - i < W ? n - i : W;
+        float ub[W], vb[W];
+        for (int k = 0; k < W; k++) {
+            ub[k] = u[i + (k < count ? k : 0)];
+            vb[k] = v[i + (k < count ? k : 0)];
+        }
+        Lanes Bu[4], dBu[4], Bv[4], dBv[4];
+        bernstein(Lanes::load(ub), Bu, dBu);
+        bernstein(Lanes::load(vb), Bv, dBv);
+        
+        Lanes x, xu, xv, y, yu, yv, z, zu, zv;
+        tensorEval(patch.x, Bu, dBu, Bv, dBv, x, xu, xv);
+        tensorEval(patch.y, Bu, dBu, Bv, dBv, y, yu, yv);
+        tensorEval(patch.z, Bu, dBu, Bv, dBv, z, zu, zv);
+        
+        // normal = normalize(cross(dPdu, dPdv))
+        Lanes cx = yu*zv - zu*yv;
+        Lanes cy = zu*xv - xu*zv;
+        Lanes cz = xu*yv - yu*xv;
+        Lanes len = sqrt(cx*cx + cy*cy + cz*cz);
+        cx = cx / len; cy = cy / len; cz = cz / len;
+        
+        float out[6][W];
+        x.store(out[0]); y.store(out[1]); z.store(out[2]);
+        cx.store(out[3]); cy.store(out[4]); cz.store(out[5]);
+        for (int k = 0; k < count; k++) {
+            px[i+k] = out[0][k]; py[i+k] = out[1][k]; pz[i+k] = out[2][k];
+            nx[i+k] = out[3][k]; ny[i+k] = out[4][k]; nz[i+k] = out[5][k];
         }
-        bezpatchinterp(patch, 1, iv, point, normal);
-        points[v][u]=point;
-        normals[v][u]=normal;
+    }
+}
 
-        u=0;
-        v++;
+//****************************************************
+// write a triangle soup as a binary little endian PLY
+// with per-vertex normals
+//***************************************************
+bool writePly(const Mesh& mesh, string file) {
+    ofstream out(file.c_str(), ios::out | ios::binary);
+    if (!out.is_open()) {
+        cout << "Unable to open output file " << file << endl;
+        return false;
     }
-    for (iu = 0; iu <= 1; iu += numdiv) {
-        
-        //evaluate surface
-        bezpatchinterp(patch, iu, 1, point, normal);
-        points[v][u]=point;
-        normals[v][u]=normal;
-        u++;
+    int numVerts = mesh.vertices.size();
+    int numTris = mesh.triangleCount();
+    out << "ply\n" << "format binary_little_endian 1.0\n";
+    out << "element vertex " << numVerts << "\n";
+    out << "property float x\nproperty float y\nproperty float z\n";
+    out << "property float nx\nproperty float ny\nproperty float nz\n";
+    out << "element face " << numTris << "\n";
+    out << "property list uchar int vertex_indices\n" << "end_header\n";
+    for (int i = 0; i < numVerts; i++) {
+        const Vertex& vert = mesh.vertices[i];
+        float v[6] = { vert.point.x, vert.point.y, vert.point.z,
+                       vert.normal.x, vert.normal.y, vert.normal.z };
+        out.write((const char*)v, sizeof(v));
     }
-    bezpatchinterp(patch, 1, 1, point, normal);
-    points[v][u]=point;
-    normals[v][u]=normal;
-    
-    // Renders the patch using the points calculated via interpolation
-    if (smooth){
-        glShadeModel(GL_SMOOTH);
-    } else {
-        glShadeModel(GL_FLAT);
+    for (int i = 0; i < numTris; i++) {
+        unsigned char n = 3;
+        int f[3] = { (int)mesh.indices[3*i], (int)mesh.indices[3*i+1], (int)mesh.indices[3*i+2] };
+        out.write((const char*)&n, 1);
+        out.write((const char*)f, sizeof(f));
     }
-    glPushMatrix();
-    glTranslatef(transX, transY, 0);
-    glRotatef(angleX, 1, 0, 0);
-    glRotatef(angleY, 0, 1, 0);
-    if (lines){
-        glBegin(GL_LINES);
-    } else {
-        glBegin(GL_TRIANGLES);
+    out.close();
+    return out.good();
+}
+
+//****************************************************
+// Triangle sinks -- the tessellators emit their output
+// into one of these instead of talking to GL directly
+//***************************************************
+class TriangleSink {
+public:
+    virtual ~TriangleSink() {}
+    virtual void begin() {}
+    virtual void triangle(const Vertex& a, const Vertex& b, const Vertex& c) = 0;
+    virtual void grid(const Vertex* verts, int nu, int nv);
+    virtual void indexed(const Mesh& mesh);
+    virtual void end() {}
+};
+
+// an indexed mesh handed over in one piece, one triangle per index triple
+void TriangleSink::indexed(const Mesh& mesh) {
+    for (int i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        triangle(mesh.vertices[mesh.indices[i]], mesh.vertices[mesh.indices[i+1]], mesh.vertices[mesh.indices[i+2]]);
     }
-    for (int k = 0; k < step; k++) {
-        for (int r = 0; r < step; r++) {
-            if (!adaptive) {
-                //BOTTOM TRIANGLE
-                glNormal3f(normals[k+1][r].x,normals[k+1][r].y,normals[k+1][r].z);
-                glVertex3f(points[k+1][r].x,points[k+1][r].y,points[k+1][r].z);
-            
-                glNormal3f(normals[k+1][r+1].x,normals[k+1][r+1].y,normals[k+1][r+1].z);
-                glVertex3f(points[k+1][r+1].x,points[k+1][r+1].y,points[k+1][r+1].z);
-                
-                glNormal3f(normals[k][r].x,normals[k][r].y,normals[k][r].z);
-                glVertex3f(points[k][r].x,points[k][r].y,points[k][r].z);
-                if (!lines){
-                    //TOP TRIANGLE
-                    glNormal3f(normals[k+1][r+1].x,normals[k+1][r+1].y,normals[k+1][r+1].z);
-                    glVertex3f(points[k+1][r+1].x,points[k+1][r+1].y,points[k+1][r+1].z);
-                
-                    glNormal3f(normals[k][r+1].x,normals[k][r+1].y,normals[k][r+1].z);
-                    glVertex3f(points[k][r+1].x,points[k][r+1].y,points[k][r+1].z);
+}
 
-                
-                    glNormal3f(normals[k][r].x,normals[k][r].y,normals[k][r].z);
-                    glVertex3f(points[k][r].x,points[k][r].y,points[k][r].z);
-                } else {
-                    glNormal3f(normals[k+1][r].x,normals[k+1][r].y,normals[k+1][r].z);
-                    glVertex3f(points[k+1][r].x,points[k+1][r].y,points[k+1][r].z);
-                }
-                
-            } else {
-                adaptiveTes(points[k][r],points[k+1][r],points[k+1][r+1],  normals[k][r], normals[k+1][r], normals[k+1][r+1], r*numdiv, k*numdiv, r*numdiv, (k+1)*numdiv,(r+1)*numdiv, (k+1)*numdiv, patch, 400);
-                adaptiveTes(points[k][r+1], points[k+1][r+1], points[k][r], normals[k][r+1], normals[k+1][r+1], normals[k][r], (r+1)*numdiv, k*numdiv, (r+1)*numdiv, (k+1)*numdiv, r*numdiv, k*numdiv, patch,400);
+// a (nu+1) x (nv+1) grid stored row by row (v major), two triangles per cell
+void TriangleSink::grid(const Vertex* verts, int nu, int nv) {
+    int row = nu + 1;
+    for (int k = 0; k < nv; k++) {
+        for (int r = 0; r < nu; r++) {
+            const Vertex* lo = verts + k*row + r;
+            const Vertex* hi = lo + row;
+            triangle(hi[0], hi[1], lo[0]); //BOTTOM TRIANGLE
+            triangle(hi[1], lo[1], lo[0]); //TOP TRIANGLE
+        }
+    }
+}
+
+// Appends triangles to a caller owned indexed mesh, grids share their vertices
+class VertexArraySink : public TriangleSink {
+public:
+    Mesh& mesh;
+    VertexArraySink(Mesh& mesh) : mesh(mesh) {}
+    void triangle(const Vertex& a, const Vertex& b, const Vertex& c) {
+        GLuint base = mesh.vertices.size();
+        mesh.vertices.push_back(a);
+        mesh.vertices.push_back(b);
+        mesh.vertices.push_back(c);
+        mesh.indices.push_back(base);
+        mesh.indices.push_back(base+1);
+        mesh.indices.push_back(base+2);
+    }
+    void indexed(const Mesh& other) {
+        GLuint base = mesh.vertices.size();
+        mesh.vertices.insert(mesh.vertices.end(), other.vertices.begin(), other.vertices.end());
+        mesh.indices.reserve(mesh.indices.size() + other.indices.size());
+        for (int i = 0; i < other.indices.size(); i++) {
+            mesh.indices.push_back(base + other.indices[i]);
+        }
+    }
+    void grid(const Vertex* verts, int nu, int nv) {
+        GLuint base = mesh.vertices.size();
+        GLuint row = nu + 1;
+        mesh.vertices.insert(mesh.vertices.end(), verts, verts + row*(nv+1));
+        mesh.indices.reserve(mesh.indices.size() + 6*nu*nv);
+        for (int k = 0; k < nv; k++) {
+            for (int r = 0; r < nu; r++) {
+                GLuint lo = base + k*row + r;
+                GLuint hi = lo + row;
+                //BOTTOM TRIANGLE
+                mesh.indices.push_back(hi);
+                mesh.indices.push_back(hi+1);
+                mesh.indices.push_back(lo);
+                //TOP TRIANGLE
+                mesh.indices.push_back(hi+1);
+                mesh.indices.push_back(lo+1);
+                mesh.indices.push_back(lo);
             }
         }
     }
-    glEnd();
-    glPopMatrix();
+};
+
+// Collects the whole mesh and writes it out as PLY at the end
+class PlyFileSink : public VertexArraySink {
+public:
+    Mesh buffer;
+    string file;
+    bool ok;
+    PlyFileSink(string file) : VertexArraySink(buffer), file(file), ok(false) {}
+    void end() { ok = writePly(buffer, file); }
+};
+
+// Throws everything away, only counts triangles. Used to time the tessellators
+class NullSink : public TriangleSink {
+public:
+    long triangles;
+    NullSink() : triangles(0) {}
+    void triangle(const Vertex& a, const Vertex& b, const Vertex& c) { triangles++; }
+    void grid(const Vertex* verts, int nu, int nv) { triangles += 2L * nu * nv; }
+    void indexed(const Mesh& mesh) { triangles += mesh.triangleCount(); }
+};
+
+//****************************************************
+// Screen space tolerance. With --screen the tolerance
+// is an error in pixels, each test turns it into an
+// object space distance from the depth of what it tests
+//***************************************************
+bool screenSpace = false; // --screen, the tolerance is in pixels of the window
+
+// The camera as the tessellator sees it, in the coordinates of the patches
+class TessView {
+public:
+    vec3 eye, forward;
+    float pixel; // size of one pixel at depth one, 0 when the tolerance is in object space
+    TessView() : eye(0), forward(0), pixel(0) {}
+    bool operator==(const TessView& other) const { return eye == other.eye && forward == other.forward && pixel == other.pixel; }
+};
+
+TessView tessView; // view of the job being tessellated, set along with tolerance
+
+// myDisplay looks from (x, 1, z) along (lx, 0, lz), then translates the model
+// by (transX, transY) and rotates it about x and then y. All of it is rigid,
+// so undoing the model transform on the eye keeps every distance
+inline vec3 unrotate(vec3 p) {
+    float cx = cos(angleX * PI / 180), sx = sin(angleX * PI / 180);
+    float cy = cos(angleY * PI / 180), sy = sin(angleY * PI / 180);
+    p = vec3(p.x, cx * p.y + sx * p.z, -sx * p.y + cx * p.z);
+    return vec3(cy * p.x - sy * p.z, p.y, sy * p.x + cy * p.z);
 }
 
+TessView currentView() {
+    TessView view;
+    if (!screenSpace || viewport.h <= 0) {
+        return view;
+    }
+    view.eye = unrotate(vec3(x - transX, 1 - transY, z));
+    view.forward = unrotate(vec3(lx, 0, lz));
+    view.pixel = 2 * tan(fieldOfView / 2 * PI / 180) / viewport.h;
+    return view;
+}
 
-    
+// The current view with everything seen at one depth: with no forward
+// direction every depth is the near plane, so the pixel size is scaled to it.
+// Camera moves leave it unchanged
+TessView fixedDepthView(float depth) {
+    TessView view = currentView();
+    view.eye = vec3(0);
+    view.forward = vec3(0);
+    view.pixel *= depth / nearPlane;
+    return view;
+}
+
+// distance in front of the eye, never nearer than the near plane
+inline float viewDepth(const vec3& p) {
+    return std::max(nearPlane, dot(p - tessView.eye, tessView.forward));
+}
+
+// the tolerance as an object space distance at this depth
+inline float toleranceAt(float depth) {
+    return tessView.pixel > 0 ? tolerance * tessView.pixel * depth : tolerance;
+}
 
+// Depth of the nearest control point of a patch or piece. Depth is linear,
+// so the surface is never nearer than that
+float patchDepth(const Patch& patch) {
+    float depth = viewDepth(patch.cp[0]);
+    for (int k = 1; k < 16; k++) {
+        depth = std::min(depth, viewDepth(patch.cp[k]));
+    }
+    return depth;
+}
 
+// the tolerance for a whole patch or piece
+float patchTolerance(const Patch& patch) {
+    return tessView.pixel > 0 ? toleranceAt(patchDepth(patch)) : tolerance;
+}
 
 //****************************************************
-// function that does the actual drawing of stuff
+// Adaptive tessellation. Triangles are refined with an
+// explicit depth first worklist instead of recursion so
+// memory stays bounded by the depth cap
 //***************************************************
-void myDisplay(void) {
-    
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // Clear Color and Depth Buffers
-    glLoadIdentity ();     // make sure transformation is "zero'd"
-    
-    gluLookAt(x, 1.0f, z, x+lx, 1.0f,  z+lz, 0.0f, 1.0f,  0.0f);
-    
-    // Sets the material properties of the teapot
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, mcolor);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, specReflection);
-    glMateriali(GL_FRONT_AND_BACK, GL_SHININESS, 96);
-    if (!adaptive){
-        bezStep=1/tolerance; // Set this in main
-    } else {
-        bezStep=1;
-    }
-    
-    //iterate through all the patches and render each patch individually
-    
-    for (int i = 0; i < patches.size(); i++) {
-        subdividepatch(patches[i],bezStep);
+// Float (u,v) has no edges shorter than 2^-149, so a deeper cap would only
+// grow the worklist. --max-depth is clamped to this
+const int depthLimit = 400;
+int maxDepth = depthLimit; // edges shorter than 2^-maxDepth in (u,v) are never split
+const int depthSlack = 32; // extra triangle levels allowed for slivers before the hard stop
+long maxTriangles = 0; // triangle budget per patch in -a, 0 means unlimited
+long triangleBudget = 20000; // -b mode, triangles for the whole model
+float timeBudget = 0; // -b mode, milliseconds of refinement, 0 means unlimited
+
+// a triangle waiting in the worklist, corner vertex indices and their (u,v) values
+class AdaptiveTri {
+public:
+    GLuint v[3];
+    vec2 uv[3];
+    int depth;
+    AdaptiveTri() {}
+    AdaptiveTri(GLuint a, GLuint b, GLuint c, vec2 uva, vec2 uvb, vec2 uvc, int depth) {
+        v[0] = a; v[1] = b; v[2] = c;
+        uv[0] = uva; uv[1] = uvb; uv[2] = uvc;
+        AdaptiveTri::depth = depth;
     }
+};
 
-    glFlush();
-    glutSwapBuffers();					// swap buffers (we earlier set double buffer)
+// Surface point and normal at uv. Points on the border of the patch come from
+// the border curve taken in a canonical direction, so two patches sharing that
+// curve produce bitwise identical points along it
+inline bool onBorder(vec2 uv) {
+    return uv.x == 0 || uv.x == 1 || uv.y == 0 || uv.y == 1;
 }
 
-// Parzer bezier files -- makes patch and curve objects from the file
-void parseFile(string file) {
-    bool init = false;
-    int lineNum = 0;
-    Patch patch;
-    Curve v0,v1,v2,v3;
-    
-    ifstream inpfile(file.c_str());
-    if(!inpfile.is_open()) {
-        cout << "Unable to open file" << endl;
+// true when a border curve runs against its canonical direction, the one
+// starting at the lexicographically smaller end
+inline bool reversedBorder(const Curve& border) {
+    const vec3 &p0 = border.p0, &p3 = border.p3;
+    return p3.x < p0.x || (p3.x == p0.x && (p3.y < p0.y || (p3.y == p0.y && p3.z < p0.z)));
+}
+
+void surfacePoint(const Patch& patch, vec2 uv, Vertex& vert) {
+    bezpatchinterp(patch, uv.x, uv.y, vert.point, vert.normal);
+    Curve border;
+    float t;
+    if (uv.y == 0 || uv.y == 1) {
+        border = patch.row(uv.y == 0 ? 0 : 3);
+        t = uv.x;
+    } else if (uv.x == 0 || uv.x == 1) {
+        border = patch.column(uv.x == 0 ? 0 : 3);
+        t = uv.y;
     } else {
-        string line;
-        while(inpfile.good()) {
-            vector<string> splitline;
-            string buf;
-            getline(inpfile,line);
-            stringstream ss(line);
-            while (ss >> buf) {
-                splitline.push_back(buf);
-            }
-            //Ignore blank lines
-            if(splitline.size() == 0) {
-                continue;
-            } else if (!init) {
-                bezStep = atoi(splitline[0].c_str()); //this isn't actually the step size, ignore it
-                lineNum = 1;
-                init = true;
-            } else {
-                vec3 p0(atof(splitline[0].c_str()),atof(splitline[1].c_str()),atof(splitline[2].c_str()));
-                vec3 p1(atof(splitline[3].c_str()),atof(splitline[4].c_str()),atof(splitline[5].c_str()));
-                vec3 p2(atof(splitline[6].c_str()),atof(splitline[7].c_str()),atof(splitline[8].c_str()));
-                vec3 p3(atof(splitline[9].c_str()),atof(splitline[10].c_str()),atof(splitline[11].c_str()));
-                Curve tmpU(p0,p1,p2,p3);
-                
-                // Based on which line number is being parsed for the current patch this switch statement
-                // sets appropriate v and u curves to given control points
-                switch (lineNum) {
-                    case 1:
-                        patch.u0 = tmpU;
-                        v0.p0 = p0;
-                        v1.p0 = p1;
-                        v2.p0 = p2;
-                        v3.p0 = p3;
-                        lineNum++;
-                        break;
-                    case 2:
-                        patch.u1 = tmpU;
-                        v0.p1 = p0;
-                        v1.p1 = p1;
-                        v2.p1 = p2;
-                        v3.p1 = p3;
-                        lineNum++;
-                        break;
-                    case 3:
-                        patch.u2 = tmpU;
-                        v0.p2 = p0;
-                        v1.p2 = p1;
-                        v2.p2 = p2;
-                        v3.p2 = p3;
-                        lineNum++;
-                        break;
-                    case 4:
-                        patch.u3 = tmpU;
-                        v0.p3 = p0;
-                        v1.p3 = p1;
-                        v2.p3 = p2;
-                        v3.p3 = p3;
-                        patch.v0=v0;
-                        patch.v1=v1;
-                        patch.v2=v2;
-                        patch.v3=v3;
-                        patches.push_back(patch);
-                        lineNum = 1;
-                        break;
-                    default:
-                        lineNum = 1;
-                        break;
-                }
-            }
-        }
-        inpfile.close();
+        return;
+    }
+    // walk the curve from its lexicographically smaller end
+    if (reversedBorder(border)) {
+        border = Curve(border.p3, border.p2, border.p1, border.p0);
+        t = 1 - t;
     }
+    vec3 dPdt;
+    bezcurveinterp(border, t, vert.point, dPdt);
 }
 
-// Function that assigns zoom amount to +/-
-void processNormalKeys(unsigned char key, int x, int y) {
-    float fraction = 0.5f;
-	if (key == 32) {
-		exit(0);
-    } else if (key == 43) {
-        //x += lx * fraction; // remove global x, unneccessary 
-        z += lz * fraction;
-    } else if (key == 45) {
-        //x -= lx * fraction;
-        z -= lz * fraction;
-    } else if (key == 119){
-        lines=!lines;
-    } else if (key == 115){
-        smooth=!smooth;
+// Border b of a patch, 0-3 for v=0, v=1, u=0 and u=1. The first two run
+// along u, the others along v
+Curve borderCurve(const Patch& patch, int b) {
+    return b < 2 ? patch.row(b == 0 ? 0 : 3) : patch.column(b == 2 ? 0 : 3);
+}
+
+// Border b in its canonical direction, keyed by its control points so every
+// patch using the same curve finds the same key. True when the patch runs the
+// curve the other way
+bool canonicalBorder(const Patch& patch, int b, Curve& curve, vector<float>& key) {
+    curve = borderCurve(patch, b);
+    bool reversed = reversedBorder(curve);
+    if (reversed) {
+        curve = Curve(curve.p3, curve.p2, curve.p1, curve.p0);
+    }
+    const vec3* p[4] = { &curve.p0, &curve.p1, &curve.p2, &curve.p3 };
+    key.clear();
+    for (int k = 0; k < 4; k++) {
+        key.push_back(p[k]->x);
+        key.push_back(p[k]->y);
+        key.push_back(p[k]->z);
     }
+    return reversed;
 }
 
-// Function that assigns rotation and transformation to directional keys
-void processSpecialKeys(int key, int xx, int yy) {
-    
-	float fraction = 0.1f;
-    int mod = glutGetModifiers();
-    
-	switch (key) {
-		case GLUT_KEY_LEFT :
-            if (mod == GLUT_ACTIVE_SHIFT){
-                transX -= 0.5f;
-            } else {
-                angleY -= 5.0f;
+// Surface points of one patch keyed by their exact (u,v), so an edge midpoint
+// shared by neighbouring triangles is evaluated once. Points only become mesh
+// vertices once a finished triangle uses them
+class MidpointCache {
+public:
+    const Patch& patch;
+    PatchSoA soa;
+    Mesh& mesh;
+    unordered_map<uint64_t, GLuint> index;
+    vector<Vertex> points;
+    vector<GLuint> meshIndex; // per point, ~0 until it is in the mesh
+    vector<float> batch; // scratch for the batch evaluator
+    vector<GLuint> pending;
+    MidpointCache(const Patch& patch, Mesh& mesh) : patch(patch), soa(patch), mesh(mesh) {}
+    static uint64_t key(vec2 uv) {
+        uint32_t u, v;
+        memcpy(&u, &uv.x, 4);
+        memcpy(&v, &uv.y, 4);
+        return ((uint64_t)u << 32) | v;
+    }
+    // id of the surface point at uv, evaluated on first use
+    GLuint at(vec2 uv) {
+        pair<unordered_map<uint64_t, GLuint>::iterator, bool> it = index.insert(make_pair(key(uv), (GLuint)points.size()));
+        if (it.second) {
+            Vertex vert;
+            surfacePoint(patch, uv, vert);
+            points.push_back(vert);
+            meshIndex.push_back(~0u);
+        }
+        return it.first->second;
+    }
+    // ids of the surface points at n uvs. The new interior ones are evaluated
+    // together in one batch call, border points need the scalar path
+    void at(const vec2* uv, int n, GLuint* ids) {
+        pending.clear();
+        batch.resize(8*n);
+        float *us = &batch[0], *vs = us + n;
+        for (int i = 0; i < n; i++) {
+            pair<unordered_map<uint64_t, GLuint>::iterator, bool> it = index.insert(make_pair(key(uv[i]), (GLuint)points.size()));
+            ids[i] = it.first->second;
+            if (!it.second) {
+                continue;
             }
-			break;
-		case GLUT_KEY_RIGHT :
-            if (mod == GLUT_ACTIVE_SHIFT){
-                transX += 0.5f;
-            } else {
-                angleY += 5.0f;
-			}
-            break;
-		case GLUT_KEY_UP :
-            if (mod == GLUT_ACTIVE_SHIFT){
-                transY += 0.5f;
+            points.push_back(Vertex());
+            meshIndex.push_back(~0u);
+            if (onBorder(uv[i])) {
+                surfacePoint(patch, uv[i], points.back());
             } else {
-                angleX += 5.0f;
+                us[pending.size()] = uv[i].x;
+                vs[pending.size()] = uv[i].y;
+                pending.push_back(ids[i]);
             }
-			break;
-		case GLUT_KEY_DOWN :
-            if (mod == GLUT_ACTIVE_SHIFT){
-                transY -= 0.5f;
-            } else {
-                angleX -= 5.0f;
+        }
+        int count = pending.size();
+        if (count > 0) {
+            float *px = vs + n, *py = px + count, *pz = py + count, *nx = pz + count, *ny = nx + count, *nz = ny + count;
+            bezpatchinterpBatch(soa, us, vs, count, px, py, pz, nx, ny, nz);
+            for (int k = 0; k < count; k++) {
+                points[pending[k]] = Vertex(vec3(px[k], py[k], pz[k]), vec3(nx[k], ny[k], nz[k]));
             }
-			break;
-	}
-}
+        }
+    }
+    // mesh vertex index of a point, added to the mesh on first use
+    GLuint emit(GLuint id) {
+        if (meshIndex[id] == ~0u) {
+            meshIndex[id] = mesh.vertices.size();
+            mesh.vertices.push_back(points[id]);
+        }
+        return meshIndex[id];
+    }
+};
 
-int main(int argc, char *argv[]) {
-    if (argc!=4){
-        printf("IMPROPER INPUTS: FILE, STEPSIZE/TOLERANCE, UNIFORM/ADAPTIVE");
-        exit(0);
+// An edge is split when the surface at its midpoint is off the chord by the
+// tolerance or more. The decision depends on nothing but the edge, so both
+// triangles sharing it, also across patches, always agree and leave no cracks.
+// In screen space the tolerance is taken at the nearest of the three points
+inline bool splitEdge(vec2 uva, vec2 uvb, vec2 uvm, const vec3& a, const vec3& b, const vec3& m) {
+    // too short to split, either past the depth cap or at float resolution
+    float length = std::max(fabs(uvb.x - uva.x), fabs(uvb.y - uva.y));
+    if (length <= ldexp(1.0f, -maxDepth) || uvm == uva || uvm == uvb) {
+        return false;
     }
-    string str(argv[1]);
-    parseFile(str);
-    if (strncmp(argv[3],"-a",2)==0){
-        adaptive=true;
-    } else {
-        adaptive=false;
+    float tol = tolerance;
+    if (tessView.pixel > 0) {
+        tol = toleranceAt(std::min(viewDepth(m), std::min(viewDepth(a), viewDepth(b))));
     }
-    tolerance=atof(argv[2]);
-  
-    //This initializes glut
-    glutInit(&argc, argv);
+    return !(distance(m, (a + b) / 2.0f) < tol);
+}
+
+// Split patterns indexed by the mask of split edges (bit e for edge e), as
+// corner (0-2) and edge midpoint (3-5) indices of the children
+const int splitCount[8] = { 1, 2, 2, 3, 2, 3, 3, 4 };
+const int splitTemplates[8][4][3] = {
+    { {0,1,2} },
+    { {0,3,2}, {3,1,2} },
+    { {0,1,4}, {0,4,2} },
+    { {0,3,2}, {3,4,2}, {3,1,4} },
+    { {0,1,5}, {5,1,2} },
+    { {0,3,5}, {5,3,2}, {3,1,2} },
+    { {0,4,5}, {0,1,4}, {5,4,2} },
+    { {0,3,5}, {3,1,4}, {5,3,4}, {5,4,2} },
+};
+
+// refines the starting triangles of one patch, in order, and hands the
+// resulting indexed mesh to the sink
+void adaptiveTes(const vector<AdaptiveTri>& roots, MidpointCache& cache, TriangleSink& sink) {
+    Mesh& mesh = cache.mesh;
     
-    //This tells glut to use a double-buffered window with red, green, and blue channels
-    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+    // depth first, every level leaves at most three siblings waiting
+    vector<AdaptiveTri> stack(roots.size() + 3*(maxDepth + depthSlack));
+    int top = 0;
+    for (int i = roots.size() - 1; i >= 0; i--) {
+        stack[top++] = roots[i];
+    }
     
-    // Initalize theviewport size
+    while (top > 0) {
+        AdaptiveTri tri = stack[--top];
+        
+        // corners 0-2, then the midpoints of edges 01, 12 and 20 as 3-5
+        GLuint p[6];
+        vec2 uv[6];
+        for (int e = 0; e < 3; e++) {
+            p[e] = tri.v[e];
+            uv[e] = tri.uv[e];
+        }
+        for (int e = 0; e < 3; e++) {
+            uv[3+e] = (uv[e] + uv[(e+1) % 3]) / 2.0f;
+        }
+        cache.at(uv + 3, 3, p + 3);
+        int mask = 0;
+        for (int e = 0; e < 3; e++) {
+            int a = e, b = (e+1) % 3;
+            mask |= splitEdge(uv[a], uv[b], uv[3+e], cache.points[p[a]].point, cache.points[p[b]].point, cache.points[p[3+e]].point) << e;
+        }
+        int children = splitCount[mask];
+        
+        // case when all sides are close enough, or we ran out of depth or budget.
+        // The last two are the only places a T-junction can still appear
+        if (children == 1 || tri.depth >= maxDepth + depthSlack
+            || (maxTriangles > 0 && mesh.triangleCount() + top + children > maxTriangles)) {
+            mesh.indices.push_back(cache.emit(tri.v[0]));
+            mesh.indices.push_back(cache.emit(tri.v[1]));
+            mesh.indices.push_back(cache.emit(tri.v[2]));
+            continue;
+        }
+        
+        // children are pushed last to first so they come back out in order
+        for (int c = children - 1; c >= 0; c--) {
+            const int* k = splitTemplates[mask][c];
+            stack[top++] = AdaptiveTri(p[k[0]], p[k[1]], p[k[2]], uv[k[0]], uv[k[1]], uv[k[2]], tri.depth + 1);
+        }
+    }
+    sink.indexed(mesh);
+}
+
+//****************************************************
+// Control net flatness subdivision. Patches are split
+// in parametric space with de Casteljau until their
+// control net is flat, the surface is only evaluated
+// at the corners of the final pieces
+//***************************************************
+
+// de Casteljau halves of the cubic p[0], p[s], p[2s], p[3s], written with the same stride
+void splitCurve(const vec3* p, int s, vec3* lo, vec3* hi) {
+    vec3 a = (p[0] + p[s]) / 2.0f, b = (p[s] + p[2*s]) / 2.0f, c = (p[2*s] + p[3*s]) / 2.0f;
+    vec3 d = (a + b) / 2.0f, e = (b + c) / 2.0f, m = (d + e) / 2.0f;
+    lo[0] = p[0]; lo[s] = a; lo[2*s] = d; lo[3*s] = m;
+    hi[0] = m; hi[s] = e; hi[2*s] = c; hi[3*s] = p[3*s];
+}
+
+// the four quarters of a patch, (u,v) = (0,0), (1,0), (0,1), (1,1) halves
+void splitPatch(const Patch& patch, Patch* quarters) {
+    Patch left, right;
+    for (int i = 0; i < 4; i++) {
+        splitCurve(patch.cp + 4*i, 1, left.cp + 4*i, right.cp + 4*i);
+    }
+    for (int j = 0; j < 4; j++) {
+        splitCurve(left.cp + j, 4, quarters[0].cp + j, quarters[2].cp + j);
+        splitCurve(right.cp + j, 4, quarters[1].cp + j, quarters[3].cp + j);
+    }
+}
+
+// Bound on the distance between the surface and the two triangles across the
+// patch corners. The surface stays within the largest offset of a control point
+// from the bilinear patch through the corners, and the two triangles stay
+// within a quarter of the twist from that bilinear patch
+float netFlatness(const Patch& patch) {
+    const vec3 &c00 = patch.cp[0], &c01 = patch.cp[3], &c10 = patch.cp[12], &c11 = patch.cp[15];
+    float offset = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            float s = j / 3.0f, t = i / 3.0f;
+            vec3 bilinear = (c00 * (1 - s) + c01 * s) * (1 - t) + (c10 * (1 - s) + c11 * s) * t;
+            offset = std::max(offset, distance(patch.cp[4*i + j], bilinear));
+        }
+    }
+    return offset + length(c00 - c01 - c10 + c11) / 4.0f;
+}
+
+// netFlatness in the units of the tolerance, pixels in screen space
+float flatError(const Patch& patch) {
+    float error = netFlatness(patch);
+    return tessView.pixel > 0 ? error / (tessView.pixel * patchDepth(patch)) : error;
+}
+
+// a finished square of the parametric domain, corner uv and side length
+class FlatLeaf {
+public:
+    vec2 uv;
+    float size;
+    FlatLeaf() {}
+    FlatLeaf(vec2 uv, float size) : uv(uv), size(size) {}
+};
+
+class FlatNode {
+public:
+    Patch patch;
+    vec2 uv;
+    int depth;
+    int index; // patch the piece comes from, budget mode only
+    float error; // flatError of the piece, budget mode only
+    bool operator<(const FlatNode& other) const { return error < other.error; }
+};
+
+// Splits a patch until every piece is flat to the tolerance, leaves come out
+// in order. Pieces stay dyadic squares, so their corners are exact in float.
+// --max-tris does not apply, the fans along finer neighbours, also those in
+// other patches, are only known once every patch is split; -b is the mode
+// with a triangle limit
+void flatSubdivide(const Patch& patch, vector<FlatLeaf>& leaves) {
+    // no piece smaller than 2^-maxDepth, nor below the float resolution of uv
+    int levels = std::min(maxDepth, 24);
+    
+    // depth first, every level leaves at most three siblings waiting
+    vector<FlatNode> stack(3*levels + 1);
+    int top = 0;
+    stack[top].patch = patch;
+    stack[top].uv = vec2(0, 0);
+    stack[top++].depth = 0;
+    
+    while (top > 0) {
+        FlatNode node = stack[--top];
+        float size = ldexp(1.0f, -node.depth);
+        if (node.depth >= levels || flatError(node.patch) < tolerance) {
+            leaves.push_back(FlatLeaf(node.uv, size));
+            continue;
+        }
+        
+        // quarters are pushed last to first so they come back out in order
+        Patch quarters[4];
+        splitPatch(node.patch, quarters);
+        float half = size / 2;
+        for (int q = 3; q >= 0; q--) {
+            stack[top].patch = quarters[q];
+            stack[top].uv = node.uv + vec2(q & 1 ? half : 0, q & 2 ? half : 0);
+            stack[top++].depth = node.depth + 1;
+        }
+    }
+}
+
+// a piece the refiner split, by patch, corner and depth
+class FlatSplit {
+public:
+    int index;
+    vec2 uv;
+    int depth;
+    FlatSplit(int index, vec2 uv, int depth) : index(index), uv(uv), depth(depth) {}
+};
+
+// Worst first refinement of the pieces of all patches together: the piece
+// with the largest flatness error in the whole model, on screen in screen
+// space, is split next, until every piece is flat to the tolerance or the
+// triangle budget is used up. It can stop at a deadline and carry on later,
+// so it also runs in time slices. The budget counts two triangles per piece
+// here, fitFlatBudget takes back the last splits if the fans along finer
+// neighbours push it over
+class FlatRefiner {
+public:
+    vector<FlatNode> heap; // std heap on the error
+    vector<vector<FlatLeaf> > finished; // per patch, pieces at the depth limit
+    vector<bool> touched; // per patch, split since the last collect
+    vector<FlatSplit> splitLog; // every piece split so far, in order
+    long pieces;
+    long budget; // triangles, 0 for no limit
+    int levels;
+    
+    FlatRefiner(long budget) : finished(patches.size()), touched(patches.size(), true),
+                               pieces(patches.size()), budget(budget), levels(std::min(maxDepth, 24)) {
+        for (int i = 0; i < patches.size(); i++) {
+            FlatNode node;
+            node.patch = patches[i];
+            node.uv = vec2(0, 0);
+            node.depth = 0;
+            node.index = i;
+            node.error = flatError(node.patch);
+            heap.push_back(node);
+        }
+        make_heap(heap.begin(), heap.end());
+    }
+    
+    // splits until the deadline, true once there is nothing left to split
+    bool refine(chrono::steady_clock::time_point deadline) {
+        for (long splits = 0; !heap.empty(); splits++) {
+            if (heap.front().error < tolerance || (budget > 0 && 2*(pieces + 3) > budget)) {
+                return true;
+            }
+            if (splits % 64 == 0 && (abandonJobs || chrono::steady_clock::now() >= deadline)) {
+                return false;
+            }
+            pop_heap(heap.begin(), heap.end());
+            FlatNode node = heap.back();
+            heap.pop_back();
+            float size = ldexp(1.0f, -node.depth);
+            touched[node.index] = true;
+            if (node.depth >= levels) {
+                finished[node.index].push_back(FlatLeaf(node.uv, size));
+                continue;
+            }
+            
+            splitLog.push_back(FlatSplit(node.index, node.uv, node.depth));
+            Patch quarters[4];
+            splitPatch(node.patch, quarters);
+            float half = size / 2;
+            for (int q = 0; q < 4; q++) {
+                FlatNode child;
+                child.patch = quarters[q];
+                child.uv = node.uv + vec2(q & 1 ? half : 0, q & 2 ? half : 0);
+                child.depth = node.depth + 1;
+                child.index = node.index;
+                child.error = flatError(child.patch);
+                heap.push_back(child);
+                push_heap(heap.begin(), heap.end());
+            }
+            pieces += 3;
+        }
+        return true;
+    }
+    
+    // the current pieces of every patch, the ones still in the heap included
+    void collect(vector<vector<FlatLeaf> >& leaves) {
+        leaves = finished;
+        for (int k = 0; k < heap.size(); k++) {
+            leaves[heap[k].index].push_back(FlatLeaf(heap[k].uv, ldexp(1.0f, -heap[k].depth)));
+        }
+        touched.assign(patches.size(), false);
+    }
+    
+    // The pieces after only the first n splits. Splitting a piece never
+    // depends on the budget, so this is what a smaller budget would have left
+    void collect(long n, vector<vector<FlatLeaf> >& leaves) {
+        // live pieces per patch by depth and corner
+        vector<set<pair<int, pair<float, float> > > > live(patches.size());
+        for (int i = 0; i < patches.size(); i++) {
+            live[i].insert(make_pair(0, make_pair(0.0f, 0.0f)));
+        }
+        for (long k = 0; k < n; k++) {
+            const FlatSplit& node = splitLog[k];
+            set<pair<int, pair<float, float> > >& pieces = live[node.index];
+            pieces.erase(make_pair(node.depth, make_pair(node.uv.x, node.uv.y)));
+            float half = ldexp(1.0f, -node.depth - 1);
+            for (int q = 0; q < 4; q++) {
+                pieces.insert(make_pair(node.depth + 1, make_pair(node.uv.x + (q & 1 ? half : 0), node.uv.y + (q & 2 ? half : 0))));
+            }
+        }
+        leaves.assign(patches.size(), vector<FlatLeaf>());
+        for (int i = 0; i < patches.size(); i++) {
+            set<pair<int, pair<float, float> > >::iterator it;
+            for (it = live[i].begin(); it != live[i].end(); ++it) {
+                leaves[i].push_back(FlatLeaf(vec2(it->second.first, it->second.second), ldexp(1.0f, -it->first)));
+            }
+        }
+        touched.assign(patches.size(), true);
+    }
+};
+
+// Leaf corners of one patch on each line of constant v (rows) and constant u
+// (columns), sorted. A leaf edge has to pass through every one of them lying
+// inside it, or the finer neighbour across it would leave a crack
+class FlatLines {
+public:
+    map<float, vector<float> > rows, columns;
+    // the line of border b, numbered as in borderCurve
+    vector<float>& border(int b) {
+        return b < 2 ? rows[b] : columns[b - 2];
+    }
+};
+
+class FlatPlan {
+public:
+    vector<vector<FlatLeaf> > leaves; // per patch
+    vector<FlatLines> lines; // per patch
+    vector<vector<float> > keys; // 4 per patch, the canonicalBorder keys
+};
+
+// Shares the corners on each border curve with every patch using the same
+// curve, so both sides of a seam get the same points
+void stitchFlatPlan(FlatPlan& plan) {
+    plan.lines.assign(patches.size(), FlatLines());
+    
+    // border points by curve, as parameters in the canonical direction
+    map<vector<float>, vector<float> > borders;
+    vector<vector<float> >& keys = plan.keys;
+    keys.assign(4*patches.size(), vector<float>());
+    vector<bool> reversed(4*patches.size());
+    
+    for (int i = 0; i < patches.size(); i++) {
+        FlatLines& lines = plan.lines[i];
+        for (int l = 0; l < plan.leaves[i].size(); l++) {
+            const FlatLeaf& leaf = plan.leaves[i][l];
+            float u0 = leaf.uv.x, v0 = leaf.uv.y, u1 = u0 + leaf.size, v1 = v0 + leaf.size;
+            lines.rows[v0].push_back(u0); lines.rows[v0].push_back(u1);
+            lines.rows[v1].push_back(u0); lines.rows[v1].push_back(u1);
+            lines.columns[u0].push_back(v0); lines.columns[u0].push_back(v1);
+            lines.columns[u1].push_back(v0); lines.columns[u1].push_back(v1);
+        }
+        for (int b = 0; b < 4; b++) {
+            Curve curve;
+            reversed[4*i + b] = canonicalBorder(patches[i], b, curve, keys[4*i + b]);
+            vector<float>& shared = borders[keys[4*i + b]];
+            const vector<float>& own = lines.border(b);
+            for (int k = 0; k < own.size(); k++) {
+                shared.push_back(reversed[4*i + b] ? 1 - own[k] : own[k]);
+            }
+        }
+    }
+    
+    for (int i = 0; i < patches.size(); i++) {
+        FlatLines& lines = plan.lines[i];
+        for (int b = 0; b < 4; b++) {
+            const vector<float>& shared = borders[keys[4*i + b]];
+            vector<float>& own = lines.border(b);
+            for (int k = 0; k < shared.size(); k++) {
+                own.push_back(reversed[4*i + b] ? 1 - shared[k] : shared[k]);
+            }
+        }
+        map<float, vector<float> >* sets[2] = { &lines.rows, &lines.columns };
+        for (int s = 0; s < 2; s++) {
+            for (map<float, vector<float> >::iterator it = sets[s]->begin(); it != sets[s]->end(); ++it) {
+                vector<float>& line = it->second;
+                sort(line.begin(), line.end());
+                line.erase(unique(line.begin(), line.end()), line.end());
+            }
+        }
+    }
+}
+
+// appends the points of a line strictly between a and b, walking from a to b
+void lineBetween(const vector<float>& line, float a, float b, vector<float>& out) {
+    if (a < b) {
+        vector<float>::const_iterator it = upper_bound(line.begin(), line.end(), a);
+        for (; it != line.end() && *it < b; ++it) {
+            out.push_back(*it);
+        }
+    } else {
+        vector<float>::const_iterator it = lower_bound(line.begin(), line.end(), a);
+        while (it != line.begin() && *--it > b) {
+            out.push_back(*it);
+        }
+    }
+}
+
+// The boundary of a leaf clockwise in (u,v), each corner followed by the
+// points finer leaves put on that side
+void leafLoop(FlatLines& lines, const FlatLeaf& leaf, vector<vec2>& loop, vector<float>& ts) {
+    float u0 = leaf.uv.x, v0 = leaf.uv.y, u1 = u0 + leaf.size, v1 = v0 + leaf.size;
+    const vec2 corners[4] = { vec2(u0, v0), vec2(u0, v1), vec2(u1, v1), vec2(u1, v0) };
+    loop.clear();
+    for (int side = 0; side < 4; side++) {
+        loop.push_back(corners[side]);
+        ts.clear();
+        switch (side) {
+            case 0: lineBetween(lines.columns[u0], v0, v1, ts); break;
+            case 1: lineBetween(lines.rows[v1], u0, u1, ts); break;
+            case 2: lineBetween(lines.columns[u1], v1, v0, ts); break;
+            case 3: lineBetween(lines.rows[v0], u1, u0, ts); break;
+        }
+        for (int k = 0; k < ts.size(); k++) {
+            loop.push_back(side % 2 == 0 ? vec2(side == 0 ? u0 : u1, ts[k]) : vec2(ts[k], side == 1 ? v1 : v0));
+        }
+    }
+}
+
+// triangles flatTes emits for a stitched plan: two per leaf with bare
+// sides, one per boundary point for a fan
+long flatTriangles(FlatPlan& plan) {
+    long triangles = 0;
+    vector<vec2> loop;
+    vector<float> ts;
+    for (int i = 0; i < patches.size(); i++) {
+        for (int l = 0; l < plan.leaves[i].size(); l++) {
+            leafLoop(plan.lines[i], plan.leaves[i][l], loop, ts);
+            triangles += loop.size() > 4 ? loop.size() : 2;
+        }
+    }
+    return triangles;
+}
+
+// Takes back the last splits of a budget refinement until what flatTes emits,
+// fans included, fits the budget. Every try scales the pieces by how far over
+// the budget the last one was. True when the plan changed
+bool fitFlatBudget(FlatRefiner& refiner, FlatPlan& plan) {
+    if (refiner.budget <= 0) {
+        return false;
+    }
+    long n = refiner.splitLog.size();
+    long emitted = flatTriangles(plan);
+    bool changed = false;
+    while (emitted > refiner.budget && n > 0) {
+        double pieces = (patches.size() + 3.0*n) * refiner.budget / emitted;
+        n = std::max(0L, std::min(n - 1, (long)((pieces - patches.size()) / 3)));
+        refiner.collect(n, plan.leaves);
+        stitchFlatPlan(plan);
+        emitted = flatTriangles(plan);
+        changed = true;
+    }
+    return changed;
+}
+
+// -b mode, refinement under triangleBudget and timeBudget in one go
+void budgetSubdivide(FlatPlan& plan) {
+    FlatRefiner refiner(triangleBudget);
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    if (timeBudget > 0) {
+        deadline = chrono::steady_clock::now() + chrono::microseconds((long)(1000 * timeBudget));
+    }
+    refiner.refine(deadline);
+    refiner.collect(plan.leaves);
+    stitchFlatPlan(plan);
+    fitFlatBudget(refiner, plan);
+}
+
+// subdivides every patch and stitches the seams
+void buildFlatPlan(FlatPlan& plan) {
+    if (tessMode == TESS_BUDGET) {
+        budgetSubdivide(plan);
+        return;
+    }
+    plan.leaves.assign(patches.size(), vector<FlatLeaf>());
+    for (int i = 0; i < patches.size() && !abandonJobs; i++) {
+        flatSubdivide(patches[i], plan.leaves[i]);
+    }
+    stitchFlatPlan(plan);
+}
+
+// Emits the leaves of one patch. A leaf is two triangles, or a fan around its
+// centre when neighbouring leaves put extra points on its edges
+void flatTes(int patchIndex, FlatPlan& plan, TriangleSink& sink) {
+    Mesh mesh;
+    MidpointCache cache(patches[patchIndex], mesh);
+    FlatLines& lines = plan.lines[patchIndex];
+    const vector<FlatLeaf>& leaves = plan.leaves[patchIndex];
+    vector<vec2> loop;
+    vector<GLuint> ids;
+    vector<float> ts;
+    
+    for (int l = 0; l < leaves.size(); l++) {
+        float u0 = leaves[l].uv.x, v0 = leaves[l].uv.y;
+        float u1 = u0 + leaves[l].size, v1 = v0 + leaves[l].size;
+        leafLoop(lines, leaves[l], loop, ts);
+        
+        // two triangles when the sides are bare, else a fan around the centre
+        bool fan = loop.size() > 4;
+        if (fan) {
+            loop.push_back(vec2((u0 + u1) / 2, (v0 + v1) / 2));
+        }
+        
+        // every point is evaluated once, interior ones four to a batch
+        int n = loop.size();
+        ids.resize(n);
+        for (int k = 0; k < n; k += 4) {
+            cache.at(&loop[k], std::min(4, n - k), &ids[k]);
+        }
+        if (!fan) {
+            GLuint tri[6] = { ids[0], ids[1], ids[2], ids[2], ids[3], ids[0] };
+            for (int k = 0; k < 6; k++) {
+                mesh.indices.push_back(cache.emit(tri[k]));
+            }
+            continue;
+        }
+        int rim = n - 1;
+        for (int k = 0; k < rim; k++) {
+            mesh.indices.push_back(cache.emit(ids[rim]));
+            mesh.indices.push_back(cache.emit(ids[k]));
+            mesh.indices.push_back(cache.emit(ids[(k + 1) % rim]));
+        }
+    }
+    sink.indexed(mesh);
+}
+
+//****************************************************
+// Work stealing thread pool. Every worker owns a queue
+// of task numbers, takes its own from the front and
+// steals from the back of the others once it runs dry
+//***************************************************
+int threadCount = std::max(1u, thread::hardware_concurrency());
+
+class WorkQueue {
+public:
+    mutex lock;
+    deque<int> tasks;
+};
+
+class ThreadPool {
+public:
+    vector<WorkQueue> queues; // one per worker, worker 0 is the thread calling run
+    vector<thread> workers;
+    const function<void(int)>* job;
+    int pending; // tasks of the current run not finished yet
+    long generation; // bumped by every run so sleeping workers know to look
+    bool stopping;
+    mutex lock;
+    condition_variable wake, finished;
+    
+    ThreadPool(int size) : queues(size), job(NULL), pending(0), generation(0), stopping(false) {
+        for (int w = 1; w < size; w++) {
+            workers.push_back(thread(&ThreadPool::worker, this, w));
+        }
+    }
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (int w = 0; w < workers.size(); w++) {
+            workers[w].join();
+        }
+    }
+    
+    // runs job(0) to job(count-1) and returns once all of them are done. Task
+    // i starts out on worker i % size, the calling thread works along
+    void run(int count, const function<void(int)>& job) {
+        if (count == 0) {
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            ThreadPool::job = &job;
+            pending = count;
+            generation++;
+        }
+        for (int i = 0; i < count; i++) {
+            WorkQueue& queue = queues[i % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back(i);
+        }
+        wake.notify_all();
+        drain(0);
+        unique_lock<mutex> guard(lock);
+        while (pending > 0) {
+            finished.wait(guard);
+        }
+    }
+    
+    void worker(int w) {
+        long seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                while (!stopping && generation == seen) {
+                    wake.wait(guard);
+                }
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            drain(w);
+        }
+    }
+    
+    // runs tasks until every queue is empty, own ones first
+    void drain(int w) {
+        int task;
+        while (take(w, task)) {
+            if (!abandonJobs) {
+                (*job)(task);
+            }
+            lock_guard<mutex> guard(lock);
+            if (--pending == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+    
+    bool take(int w, int& task) {
+        for (int k = 0; k < queues.size(); k++) {
+            WorkQueue& queue = queues[(w + k) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (k == 0) {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            } else {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+// the pool of threadCount workers, started on first use
+ThreadPool& threadPool() {
+    static ThreadPool pool(threadCount);
+    return pool;
+}
+
+//****************************************************
+// Uniform grid evaluators. Each fills the (step+1)^2
+// vertices of a patch row by row (v major)
+//***************************************************
+enum GridEngine { GRID_SCALAR, GRID_BATCH, GRID_SEPARABLE, GRID_FORWARD, GRID_TABLE, GRID_GEMM };
+GridEngine gridEngine = GRID_FORWARD;
+
+// parametric value of grid line i, exactly 1 on the last one
+inline float gridParam(int i, int step) {
+    return i == step ? 1.0f : (float)i / step;
+}
+
+// reference engine, one full bezpatchinterp per vertex
+void evalGridScalar(const Patch& patch, int step, Vertex* verts) {
+    int row = step + 1;
+    for (int v = 0; v < row; v++) {
+        for (int u = 0; u < row; u++) {
+            Vertex& vert = verts[v*row + u];
+            bezpatchinterp(patch, gridParam(u, step), gridParam(v, step), vert.point, vert.normal);
+        }
+    }
+}
+
+// all grid vertices through the SIMD batch evaluator
+void evalGridBatch(const Patch& patch, int step, Vertex* verts) {
+    int row = step + 1;
+    int n = row * row;
+    vector<float> params(2*n), soa(6*n);
+    float *us = &params[0], *vs = us + n;
+    
+    //every parametric value (iu, iv) of the grid, row by row
+    for (int v = 0; v < row; v++) {
+        for (int u = 0; u < row; u++) {
+            us[v*row + u] = gridParam(u, step);
+            vs[v*row + u] = gridParam(v, step);
+        }
+    }
+    
+    //evaluate surface at all of them in one batch
+    float *px = &soa[0], *py = px + n, *pz = py + n, *nx = pz + n, *ny = nx + n, *nz = ny + n;
+    bezpatchinterpBatch(PatchSoA(patch), us, vs, n, px, py, pz, nx, ny, nz);
+    for (int i = 0; i < n; i++) {
+        verts[i] = Vertex(vec3(px[i], py[i], pz[i]), vec3(nx[i], ny[i], nz[i]));
+    }
+}
+
+// Separable engine: within one grid row v is fixed, so the four columns are
+// collapsed into one curve in u (and its v derivative curve) once per row,
+// leaving two curve evaluations per vertex instead of ten
+void evalGridSeparable(const Patch& patch, int step, Vertex* verts) {
+    int row = step + 1;
+    for (int v = 0; v < row; v++) {
+        float iv = gridParam(v, step);
+        Curve ucurve, dvcurve;
+        vec3* q[4] = { &ucurve.p0, &ucurve.p1, &ucurve.p2, &ucurve.p3 };
+        vec3* dq[4] = { &dvcurve.p0, &dvcurve.p1, &dvcurve.p2, &dvcurve.p3 };
+        for (int j = 0; j < 4; j++) {
+            bezcurveinterp(patch.column(j), iv, *q[j], *dq[j]);
+        }
+        for (int u = 0; u < row; u++) {
+            float iu = gridParam(u, step);
+            vec3 dPdu, dPdv, unused;
+            Vertex& vert = verts[v*row + u];
+            bezcurveinterp(ucurve, iu, vert.point, dPdu);
+            bezcurveinterp(dvcurve, iu, dPdv, unused);
+            vert.normal = normalize(cross(dPdu, dPdv));
+        }
+    }
+}
+
+// Forward difference table of a cubic f(t) = a + b t + c t^2 + d t^3 sampled
+// every h, kept in double so the drift stays far below float precision
+class ForwardDiff {
+public:
+    dvec3 f, d1, d2, d3;
+    ForwardDiff() {}
+    ForwardDiff(dvec3 a, dvec3 b, dvec3 c, dvec3 d, double h) {
+        double h2 = h*h, h3 = h2*h;
+        f = a;
+        d1 = b*h + c*h2 + d*h3;
+        d2 = 2.0*c*h2 + 6.0*d*h3;
+        d3 = 6.0*d*h3;
+    }
+    void step() {
+        f += d1;
+        d1 += d2;
+        d2 += d3;
+    }
+};
+
+// Forward differencing engine: the patch is converted once into its power basis
+// coefficients, then every vertex and both partial derivatives come out of a
+// few additions along v (per row) and along u (per vertex)
+void evalGridForward(const Patch& patch, int step, Vertex* verts) {
+    int row = step + 1;
+    double h = 1.0 / step;
+    static const double M[4][4] = { { 1, 0, 0, 0}, {-3, 3, 0, 0}, { 3,-6, 3, 0}, {-1, 3,-3, 1} };
+    dvec3 A[4][4];
+    // A = M P M^T, S(u,v) = sum A[k][l] v^k u^l
+    for (int k = 0; k < 4; k++) {
+        for (int l = 0; l < 4; l++) {
+            A[k][l] = dvec3(0.0);
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    A[k][l] += M[k][i] * M[l][j] * dvec3(patch.at(i, j));
+                }
+            }
+        }
+    }
+    // power coefficients in u of S (cubic in v) and of dS/dv (quadratic in v), stepped along v
+    ForwardDiff c[4], dc[4];
+    for (int l = 0; l < 4; l++) {
+        c[l] = ForwardDiff(A[0][l], A[1][l], A[2][l], A[3][l], h);
+        dc[l] = ForwardDiff(A[1][l], 2.0*A[2][l], 3.0*A[3][l], dvec3(0.0), h);
+    }
+    for (int v = 0; v < row; v++) {
+        ForwardDiff S(c[0].f, c[1].f, c[2].f, c[3].f, h);
+        ForwardDiff Su(c[1].f, 2.0*c[2].f, 3.0*c[3].f, dvec3(0.0), h);
+        ForwardDiff Sv(dc[0].f, dc[1].f, dc[2].f, dc[3].f, h);
+        for (int u = 0; u < row; u++) {
+            Vertex& vert = verts[v*row + u];
+            vert.point = vec3(S.f);
+            vert.normal = normalize(cross(vec3(Su.f), vec3(Sv.f)));
+            S.step(); Su.step(); Sv.step();
+        }
+        for (int l = 0; l < 4; l++) {
+            c[l].step();
+            dc[l].step();
+        }
+    }
+}
+
+// Cubic Bernstein weights B(t) and derivative weights B'(t) at the step+1
+// grid parameters, built once per step count and shared by every patch
+class BasisTable {
+public:
+    vector<vec4> B, dB;
+    BasisTable() {}
+    BasisTable(int step) {
+        B.resize(step + 1);
+        dB.resize(step + 1);
+        for (int i = 0; i <= step; i++) {
+            float t = gridParam(i, step), s = 1 - t;
+            B[i] = vec4(s*s*s, 3*t*s*s, 3*t*t*s, t*t*t);
+            dB[i] = vec4(-3*s*s, 3*s*s - 6*t*s, 6*t*s - 3*t*t, 3*t*t);
+        }
+    }
+};
+
+map<int, BasisTable> basisTables;
+mutex basisTablesLock; // patches on the thread pool ask for tables concurrently
+
+const BasisTable& basisTable(int step) {
+    lock_guard<mutex> guard(basisTablesLock);
+    map<int, BasisTable>::iterator it = basisTables.find(step);
+    if (it == basisTables.end()) {
+        it = basisTables.insert(make_pair(step, BasisTable(step))).first;
+    }
+    return it->second;
+}
+
+// Table engine: tensor product evaluation with the weights looked up from the
+// basis table, collapsing the rows in v once per grid row
+void evalGridTable(const Patch& patch, int step, Vertex* verts) {
+    int row = step + 1;
+    const BasisTable& table = basisTable(step);
+    for (int v = 0; v < row; v++) {
+        const vec4& Bv = table.B[v];
+        const vec4& dBv = table.dB[v];
+        vec3 q[4], dq[4];
+        for (int j = 0; j < 4; j++) {
+            q[j] = dq[j] = vec3(0);
+        }
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                q[j] += Bv[i] * patch.at(i, j);
+                dq[j] += dBv[i] * patch.at(i, j);
+            }
+        }
+        for (int u = 0; u < row; u++) {
+            const vec4& Bu = table.B[u];
+            const vec4& dBu = table.dB[u];
+            Vertex& vert = verts[v*row + u];
+            vert.point = Bu.x*q[0] + Bu.y*q[1] + Bu.z*q[2] + Bu.w*q[3];
+            vec3 dPdu = dBu.x*q[0] + dBu.y*q[1] + dBu.z*q[2] + dBu.w*q[3];
+            vec3 dPdv = Bu.x*dq[0] + Bu.y*dq[1] + Bu.z*dq[2] + Bu.w*dq[3];
+            vert.normal = normalize(cross(dPdu, dPdv));
+        }
+    }
+}
+
+//****************************************************
+// GEMM backend. A step-N grid is a fixed linear map of
+// the 16 control points, so all patches are evaluated at
+// once as W (samples x 16) times C (16 x 3*patches), with
+// Wu and Wv as the stencils of the partial derivatives
+//***************************************************
+class Stencil {
+public:
+    int step, samples;
+    vector<float> W, Wu, Wv; // samples x 16, row major, column 4*i+j weights row i column j
+    Stencil() : step(0), samples(0) {}
+    Stencil(int step) : step(step) {
+        int row = step + 1;
+        const BasisTable& table = basisTable(step);
+        samples = row * row;
+        W.resize(16 * samples);
+        Wu.resize(16 * samples);
+        Wv.resize(16 * samples);
+        for (int v = 0; v < row; v++) {
+            for (int u = 0; u < row; u++) {
+                int s = v*row + u;
+                for (int i = 0; i < 4; i++) {
+                    for (int j = 0; j < 4; j++) {
+                        W[16*s + 4*i+j] = table.B[v][i] * table.B[u][j];
+                        Wu[16*s + 4*i+j] = table.B[v][i] * table.dB[u][j];
+                        Wv[16*s + 4*i+j] = table.dB[v][i] * table.B[u][j];
+                    }
+                }
+            }
+        }
+    }
+};
+
+// A stencil is 48 floats per sample, so only the last few step counts are
+// kept. Callers hold on to theirs while the pool runs, an evicted one goes
+// away when its last caller is done with it
+const int keptStencils = 2;
+vector<shared_ptr<const Stencil> > stencils; // most recently used last
+mutex stencilsLock;
+
+shared_ptr<const Stencil> stencil(int step) {
+    lock_guard<mutex> guard(stencilsLock);
+    for (int k = 0; k < stencils.size(); k++) {
+        if (stencils[k]->step == step) {
+            shared_ptr<const Stencil> st = stencils[k];
+            stencils.erase(stencils.begin() + k);
+            stencils.push_back(st);
+            return st;
+        }
+    }
+    if (stencils.size() >= keptStencils) {
+        stencils.erase(stencils.begin());
+    }
+    stencils.push_back(make_shared<const Stencil>(step));
+    return stencils.back();
+}
+
+// multiplies rows [s0, s1) of the stencils with the packed control points C
+// (16 x cols, row major), one cache sized block of rows and columns at a time,
+// and writes the resulting vertices to out[patch * samples + sample]
+void gemmRows(const Stencil& st, const float* C, int cols, int s0, int s1, Vertex* out) {
+    const int BS = 32;     // samples per block
+    const int BC = 3*64;   // columns per block, 64 patches
+    vector<float> buffer(3 * BS * BC);
+    float *O = &buffer[0], *Ou = O + BS*BC, *Ov = Ou + BS*BC;
+    
+    for (int sb = s0; sb < s1; sb += BS) {
+        int ns = std::min(BS, s1 - sb);
+        for (int cb = 0; cb < cols; cb += BC) {
+            int nc = std::min(BC, cols - cb);
+            for (int s = 0; s < ns; s++) {
+                float* o = O + s*BC;
+                float* ou = Ou + s*BC;
+                float* ov = Ov + s*BC;
+                for (int c = 0; c < nc; c++) {
+                    o[c] = ou[c] = ov[c] = 0;
+                }
+                const float* w = &st.W[16*(sb+s)];
+                const float* wu = &st.Wu[16*(sb+s)];
+                const float* wv = &st.Wv[16*(sb+s)];
+                for (int k = 0; k < 16; k++) {
+                    const float* ck = C + k*cols + cb;
+                    for (int c = 0; c < nc; c++) {
+                        o[c] += w[k] * ck[c];
+                        ou[c] += wu[k] * ck[c];
+                        ov[c] += wv[k] * ck[c];
+                    }
+                }
+            }
+            for (int s = 0; s < ns; s++) {
+                for (int c = 0; c < nc; c += 3) {
+                    const float* o = O + s*BC + c;
+                    const float* ou = Ou + s*BC + c;
+                    const float* ov = Ov + s*BC + c;
+                    Vertex& vert = out[(long)((cb + c) / 3) * st.samples + sb + s];
+                    vert.point = vec3(o[0], o[1], o[2]);
+                    vert.normal = normalize(cross(vec3(ou[0], ou[1], ou[2]), vec3(ov[0], ov[1], ov[2])));
+                }
+            }
+        }
+    }
+}
+
+// evaluates the step-N grids of every patch in one GEMM on the thread pool,
+// grid i starts at verts[i * (step+1)^2]
+void evalGridsGemm(const vector<Patch>& patches, int step, Vertex* verts) {
+    shared_ptr<const Stencil> held = stencil(step);
+    const Stencil& st = *held;
+    int cols = 3 * patches.size();
+    if (cols == 0) {
+        return;
+    }
+    vector<float> C(16 * cols);
+    for (int p = 0; p < patches.size(); p++) {
+        PatchSoA soa(patches[p]);
+        for (int k = 0; k < 16; k++) {
+            C[k*cols + 3*p] = soa.x[k];
+            C[k*cols + 3*p+1] = soa.y[k];
+            C[k*cols + 3*p+2] = soa.z[k];
+        }
+    }
+    
+    // contiguous ranges of samples as pool tasks, a few per thread so
+    // stealing can even them out
+    int tasks = std::max(1, std::min(4 * threadCount, (st.samples + 31) / 32));
+    int chunk = (st.samples + tasks - 1) / tasks;
+    function<void(int)> task = [&](int t) {
+        int s0 = t * chunk, s1 = std::min(st.samples, s0 + chunk);
+        if (s0 < s1) {
+            gemmRows(st, &C[0], cols, s0, s1, verts);
+        }
+    };
+    threadPool().run(tasks, task);
+}
+
+void evalGrid(const Patch& patch, int step, Vertex* verts) {
+    switch (gridEngine) {
+        case GRID_SCALAR:
+            evalGridScalar(patch, step, verts);
+            break;
+        case GRID_SEPARABLE:
+            evalGridSeparable(patch, step, verts);
+            break;
+        case GRID_FORWARD:
+            evalGridForward(patch, step, verts);
+            break;
+        case GRID_TABLE:
+            evalGridTable(patch, step, verts);
+            break;
+        case GRID_GEMM:
+            evalGridsGemm(vector<Patch>(1, patch), step, verts);
+            break;
+        default:
+            evalGridBatch(patch, step, verts);
+            break;
+    }
+}
+
+//****************************************************
+// A-priori grid sizes per patch. The second differences
+// of the control net bound the second derivatives of the
+// surface, which bound how far a grid is off the surface
+//***************************************************
+
+// Grid steps in u and v for one patch to stay within the tolerance. On cells
+// of h_u by h_v the linear interpolant is off by at most
+// (h_u^2 Suu + 2 h_u h_v Suv + h_v^2 Svv) / 8, where Suu <= 6 max|D2u P|,
+// Suv <= 9 max|DuDv P| and Svv <= 6 max|D2v P|. Splitting the mixed term
+// evenly gives each direction half the tolerance
+void patchSteps(const Patch& patch, int& nu, int& nv) {
+    float tol = patchTolerance(patch);
+    float duu = 0, dvv = 0, duv = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 2; j++) {
+            duu = std::max(duu, length(patch.at(i, j) - 2.0f * patch.at(i, j+1) + patch.at(i, j+2)));
+            dvv = std::max(dvv, length(patch.at(j, i) - 2.0f * patch.at(j+1, i) + patch.at(j+2, i)));
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            duv = std::max(duv, length(patch.at(i+1, j+1) - patch.at(i+1, j) - patch.at(i, j+1) + patch.at(i, j)));
+        }
+    }
+    nu = std::max(1, (int)ceil(sqrt((6*duu + 9*duv) / (4*tol))));
+    nv = std::max(1, (int)ceil(sqrt((6*dvv + 9*duv) / (4*tol))));
+}
+
+// Steps of every patch, and of each border. A border takes the largest step
+// count of the patches sharing its curve, so both sides of a seam put their
+// points at the same parameters
+class RatePlan {
+public:
+    vector<int> nu, nv; // per patch
+    vector<int> edges; // 4 per patch, numbered as in borderCurve
+};
+
+// -p, and -u in screen space where no single step suits every depth. Uniform
+// keeps the grid of each patch square
+bool ratePlanned() {
+    return tessMode == TESS_RATE || (tessMode == TESS_UNIFORM && tessView.pixel > 0);
+}
+
+void buildRatePlan(RatePlan& plan) {
+    plan.nu.resize(patches.size());
+    plan.nv.resize(patches.size());
+    plan.edges.resize(4*patches.size());
+    map<vector<float>, int> shared;
+    vector<vector<float> > keys(4*patches.size());
+    
+    for (int i = 0; i < patches.size(); i++) {
+        patchSteps(patches[i], plan.nu[i], plan.nv[i]);
+        if (tessMode == TESS_UNIFORM) {
+            plan.nu[i] = plan.nv[i] = std::max(plan.nu[i], plan.nv[i]);
+        }
+        for (int b = 0; b < 4; b++) {
+            Curve curve;
+            canonicalBorder(patches[i], b, curve, keys[4*i + b]);
+            int& rate = shared[keys[4*i + b]];
+            rate = std::max(rate, b < 2 ? plan.nu[i] : plan.nv[i]);
+        }
+    }
+    for (int i = 0; i < 4*patches.size(); i++) {
+        plan.edges[i] = shared[keys[i]];
+    }
+}
+
+// Triangulates the band between a border (outer, m segments) and the parallel
+// line of the inner grid (n segments), advancing whichever side's next point
+// comes first along the border. Triangles are handed out as index triples
+void zipper(const GLuint* outer, const float* outerAt, int m, const GLuint* inner, const float* innerAt, int n, vector<GLuint>& tris) {
+    int a = 0, b = 0;
+    while (a < m || b < n) {
+        if (b == n || (a < m && outerAt[a+1] <= innerAt[b+1])) {
+            GLuint tri[3] = { outer[a], outer[a+1], inner[b] };
+            tris.insert(tris.end(), tri, tri + 3);
+            a++;
+        } else {
+            GLuint tri[3] = { outer[a], inner[b+1], inner[b] };
+            tris.insert(tris.end(), tri, tri + 3);
+            b++;
+        }
+    }
+}
+
+// Emits one patch of the per patch rate mode. When every border has the
+// patch's own step count it is a plain nu x nv grid. Otherwise the inner grid
+// is kept and each border is zipped to the first inner grid line next to it
+void rateTes(int patchIndex, const RatePlan& plan, TriangleSink& sink) {
+    const Patch& patch = patches[patchIndex];
+    int nu = plan.nu[patchIndex], nv = plan.nv[patchIndex];
+    const int* edges = &plan.edges[4*patchIndex];
+    bool plain = edges[0] == nu && edges[1] == nu && edges[2] == nv && edges[3] == nv;
+    if (!plain) {
+        // the zipper needs at least one inner grid line in each direction
+        nu = std::max(nu, 2);
+        nv = std::max(nv, 2);
+    }
+    
+    // grid ids row by row (v major), borders in increasing u or v. Corners
+    // are shared, border points are added before the inner grid
+    Mesh mesh;
+    vector<vec2> uvs;
+    vector<GLuint> grid((nu+1) * (nv+1));
+    vector<GLuint> border[4];
+    vector<float> borderAt[4];
+    const vec2 corners[4] = { vec2(0, 0), vec2(1, 0), vec2(0, 1), vec2(1, 1) };
+    for (int c = 0; c < 4; c++) {
+        uvs.push_back(corners[c]);
+    }
+    for (int b = 0; b < 4; b++) {
+        int e = edges[b];
+        GLuint first = b < 2 ? (b == 0 ? 0 : 2) : (b == 2 ? 0 : 1);
+        GLuint last = b < 2 ? (b == 0 ? 1 : 3) : (b == 2 ? 2 : 3);
+        for (int k = 0; k <= e; k++) {
+            float t = gridParam(k, e);
+            borderAt[b].push_back(t);
+            if (k == 0 || k == e) {
+                border[b].push_back(k == 0 ? first : last);
+                continue;
+            }
+            border[b].push_back(uvs.size());
+            uvs.push_back(b < 2 ? vec2(t, b == 0 ? 0 : 1) : vec2(b == 2 ? 0 : 1, t));
+        }
+    }
+    for (int j = 0; j <= nv; j++) {
+        for (int i = 0; i <= nu; i++) {
+            if (j == 0 || j == nv) {
+                grid[j*(nu+1) + i] = plain ? border[j == 0 ? 0 : 1][i] : ~0u;
+            } else if (i == 0 || i == nu) {
+                grid[j*(nu+1) + i] = plain ? border[i == 0 ? 2 : 3][j] : ~0u;
+            } else {
+                grid[j*(nu+1) + i] = uvs.size();
+                uvs.push_back(vec2(gridParam(i, nu), gridParam(j, nv)));
+            }
+        }
+    }
+    
+    // every point in one batch, then the border positions again from the
+    // canonical border curves so neighbours agree on them bit for bit
+    int n = uvs.size();
+    vector<float> params(2*n), soa(6*n);
+    float *us = &params[0], *vs = us + n;
+    for (int k = 0; k < n; k++) {
+        us[k] = uvs[k].x;
+        vs[k] = uvs[k].y;
+    }
+    float *px = &soa[0], *py = px + n, *pz = py + n, *nx = pz + n, *ny = nx + n, *nz = ny + n;
+    bezpatchinterpBatch(PatchSoA(patch), us, vs, n, px, py, pz, nx, ny, nz);
+    mesh.vertices.resize(n);
+    for (int k = 0; k < n; k++) {
+        mesh.vertices[k] = Vertex(vec3(px[k], py[k], pz[k]), vec3(nx[k], ny[k], nz[k]));
+    }
+    for (int b = 0; b < 4; b++) {
+        Curve curve;
+        vector<float> key;
+        bool reversed = canonicalBorder(patch, b, curve, key);
+        int e = edges[b];
+        for (int k = 0; k <= e; k++) {
+            vec3 dPdt;
+            bezcurveinterp(curve, gridParam(reversed ? e - k : k, e), mesh.vertices[border[b][k]].point, dPdt);
+        }
+    }
+    
+    // cells of the inner grid, the whole grid when plain
+    int lo = plain ? 0 : 1;
+    vector<GLuint>& tris = mesh.indices;
+    for (int j = lo; j < nv - lo; j++) {
+        for (int i = lo; i < nu - lo; i++) {
+            GLuint a = grid[j*(nu+1) + i], b = grid[j*(nu+1) + i+1];
+            GLuint c = grid[(j+1)*(nu+1) + i], d = grid[(j+1)*(nu+1) + i+1];
+            GLuint cell[6] = { c, d, a, d, b, a };
+            tris.insert(tris.end(), cell, cell + 6);
+        }
+    }
+    if (!plain) {
+        // the first inner grid line next to each border, with its parameters
+        for (int b = 0; b < 4; b++) {
+            vector<GLuint> line;
+            vector<float> lineAt;
+            int count = b < 2 ? nu : nv;
+            for (int k = 1; k < count; k++) {
+                int i = b < 2 ? k : (b == 2 ? 1 : nu - 1);
+                int j = b < 2 ? (b == 0 ? 1 : nv - 1) : k;
+                line.push_back(grid[j*(nu+1) + i]);
+                lineAt.push_back(gridParam(k, count));
+            }
+            int first = tris.size();
+            zipper(&border[b][0], &borderAt[b][0], edges[b], &line[0], &lineAt[0], count - 2, tris);
+            // keep every triangle clockwise in (u,v) like the grid cells
+            for (int t = first; t < tris.size(); t += 3) {
+                vec2 p = uvs[tris[t]], q = uvs[tris[t+1]], r = uvs[tris[t+2]];
+                if ((q.x - p.x) * (r.y - p.y) - (q.y - p.y) * (r.x - p.x) > 0) {
+                    std::swap(tris[t+1], tris[t+2]);
+                }
+            }
+        }
+    }
+    sink.indexed(mesh);
+}
+
+// The starting triangles of an adaptive patch, two per cell of a step x step
+// grid. The grid goes through the cache too, so border points are evaluated
+// the same way their neighbouring patch does
+void adaptiveRoots(int step, MidpointCache& cache, vector<AdaptiveTri>& roots) {
+    int row = step + 1;
+    vector<GLuint> ids(row * row);
+    for (int k = 0; k < row; k++) {
+        for (int r = 0; r < row; r++) {
+            ids[k*row + r] = cache.at(vec2(gridParam(r, step), gridParam(k, step)));
+        }
+    }
+    roots.reserve(roots.size() + 2*step*step);
+    for (int k = 0; k < step; k++) {
+        for (int r = 0; r < step; r++) {
+            GLuint lo = k*row + r, hi = lo + row;
+            vec2 uvlo0(gridParam(r, step), gridParam(k, step)), uvlo1(gridParam(r+1, step), gridParam(k, step));
+            vec2 uvhi0(gridParam(r, step), gridParam(k+1, step)), uvhi1(gridParam(r+1, step), gridParam(k+1, step));
+            roots.push_back(AdaptiveTri(ids[lo], ids[hi], ids[hi+1], uvlo0, uvhi0, uvhi1, 0));
+            roots.push_back(AdaptiveTri(ids[lo+1], ids[lo], ids[hi+1], uvlo1, uvlo0, uvhi1, 0));
+        }
+    }
+}
+
+//****************************************************
+// Wavefront adaptive engine. The live triangles of one
+// refinement level are a flat array: every midpoint the
+// level needs is evaluated in one batch per patch, the
+// patches run on the thread pool, and the children are
+// compacted into the next level
+//***************************************************
+enum AdaptiveEngine { ADAPTIVE_DEPTH, ADAPTIVE_WAVEFRONT };
+AdaptiveEngine adaptiveEngine = ADAPTIVE_DEPTH;
+bool progress = false; // report every wavefront level on the console
+
+// one patch's share of the wavefront
+class WavefrontPatch {
+public:
+    Mesh mesh;
+    MidpointCache cache;
+    vector<AdaptiveTri> live, next;
+    vector<vec2> uvs; // midpoints of the level, three per live triangle
+    vector<GLuint> ids;
+    WavefrontPatch(const Patch& patch) : cache(patch, mesh) {}
+};
+
+// Refines the live triangles of one patch by one level. Split decisions are
+// the same as adaptiveTes makes, only the order of the finished triangles differs
+void wavefrontLevel(WavefrontPatch& wave) {
+    int n = wave.live.size();
+    wave.uvs.resize(3*n);
+    wave.ids.resize(3*n);
+    for (int t = 0; t < n; t++) {
+        const AdaptiveTri& tri = wave.live[t];
+        for (int e = 0; e < 3; e++) {
+            wave.uvs[3*t + e] = (tri.uv[e] + tri.uv[(e+1) % 3]) / 2.0f;
+        }
+    }
+    wave.cache.at(&wave.uvs[0], 3*n, &wave.ids[0]);
+    
+    wave.next.clear();
+    for (int t = 0; t < n; t++) {
+        const AdaptiveTri& tri = wave.live[t];
+        
+        // corners 0-2, then the midpoints of edges 01, 12 and 20 as 3-5
+        GLuint p[6];
+        vec2 uv[6];
+        for (int e = 0; e < 3; e++) {
+            p[e] = tri.v[e];
+            uv[e] = tri.uv[e];
+            p[3+e] = wave.ids[3*t + e];
+            uv[3+e] = wave.uvs[3*t + e];
+        }
+        const vector<Vertex>& points = wave.cache.points;
+        int mask = 0;
+        for (int e = 0; e < 3; e++) {
+            int a = e, b = (e+1) % 3;
+            mask |= splitEdge(uv[a], uv[b], uv[3+e], points[p[a]].point, points[p[b]].point, points[p[3+e]].point) << e;
+        }
+        int children = splitCount[mask];
+        
+        // the budget counts what is finished, what the next level already
+        // holds and the rest of this level
+        if (children == 1 || tri.depth >= maxDepth + depthSlack
+            || (maxTriangles > 0 && wave.mesh.triangleCount() + wave.next.size() + (n - t - 1) + children > maxTriangles)) {
+            wave.mesh.indices.push_back(wave.cache.emit(tri.v[0]));
+            wave.mesh.indices.push_back(wave.cache.emit(tri.v[1]));
+            wave.mesh.indices.push_back(wave.cache.emit(tri.v[2]));
+            continue;
+        }
+        for (int c = 0; c < children; c++) {
+            const int* k = splitTemplates[mask][c];
+            wave.next.push_back(AdaptiveTri(p[k[0]], p[k[1]], p[k[2]], uv[k[0]], uv[k[1]], uv[k[2]], tri.depth + 1));
+        }
+    }
+    wave.live.swap(wave.next);
+}
+
+// Adaptive tessellation of every patch, one level at a time for all of them
+void wavefrontTes(int step, vector<Mesh>& meshes) {
+    deque<WavefrontPatch> waves;
+    for (int i = 0; i < patches.size(); i++) {
+        waves.emplace_back(patches[i]);
+        adaptiveRoots(step, waves.back().cache, waves.back().live);
+    }
+    
+    vector<int> active;
+    function<void(int)> task = [&](int k) {
+        wavefrontLevel(waves[active[k]]);
+    };
+    for (int level = 0; ; level++) {
+        active.clear();
+        long live = 0, finished = 0;
+        for (int i = 0; i < waves.size(); i++) {
+            if (!waves[i].live.empty()) {
+                active.push_back(i);
+                live += waves[i].live.size();
+            }
+            finished += waves[i].mesh.triangleCount();
+        }
+        if (progress) {
+            cout << "level " << level << ": " << live << " live triangles in " << active.size()
+                 << " patches, " << finished << " finished" << endl;
+        }
+        if (active.empty() || abandonJobs) {
+            break;
+        }
+        threadPool().run(active.size(), task);
+    }
+    
+    meshes.assign(patches.size(), Mesh());
+    for (int i = 0; i < patches.size(); i++) {
+        meshes[i].swap(waves[i].mesh);
+    }
+}
+
+// What the modes work out for all patches at once before any patch is
+// emitted, filled in by planTessellation
+class TessPlan {
+public:
+    int step;
+    vector<Vertex> grids; // GEMM engine, (step+1)^2 vertices per patch, else empty
+    FlatPlan flat; // -f and -b, the pieces and their seams
+    RatePlan rates; // -p and screen space -u, steps per patch and border
+    const Vertex* grid(int i) const {
+        return grids.empty() ? NULL : &grids[(long)i * (step+1) * (step+1)];
+    }
+};
+
+//****************************************************
+// given a patch, perform uniform subdivision compute how
+// many subdivisions there are for this step size
+//***************************************************
+// root picks a single starting triangle of an adaptive patch, -1 means all.
+// keys, when given, gets the MidpointCache key of every adaptive vertex so
+// parts of one patch can be joined on their shared points
+void subdividepatch(int index, int step, TriangleSink& sink, TessPlan& plan, int root = -1, vector<uint64_t>* keys = NULL) {
+    int row = step + 1;
+    const Vertex* grid = plan.grid(index);
+    
+    if (ratePlanned()) {
+        rateTes(index, plan.rates, sink);
+        return;
+    }
+    // Emits the patch using the points calculated via interpolation
+    if (tessMode == TESS_UNIFORM) {
+        vector<Vertex> verts;
+        if (!grid) {
+            verts.resize(row * row);
+            evalGrid(patches[index], step, &verts[0]);
+            grid = &verts[0];
+        }
+        sink.grid(grid, step, step);
+        return;
+    }
+    if (tessMode == TESS_FLAT || tessMode == TESS_BUDGET) {
+        flatTes(index, plan.flat, sink);
+        return;
+    }
+    
+    Mesh mesh;
+    MidpointCache cache(patches[index], mesh);
+    vector<AdaptiveTri> roots;
+    adaptiveRoots(step, cache, roots);
+    if (root >= 0) {
+        roots = vector<AdaptiveTri>(1, roots[root]);
+    }
+    adaptiveTes(roots, cache, sink);
+    if (keys) {
+        keys->resize(mesh.vertices.size());
+        for (unordered_map<uint64_t, GLuint>::iterator it = cache.index.begin(); it != cache.index.end(); ++it) {
+            if (cache.meshIndex[it->second] != ~0u) {
+                (*keys)[cache.meshIndex[it->second]] = it->first;
+            }
+        }
+    }
+}
+
+//****************************************************
+// tessellate every patch at the current settings
+//***************************************************
+int stepSize() {
+    if (tessMode == TESS_UNIFORM && tessView.pixel <= 0){
+        return 1/tolerance;
+    } else {
+        return 1;
+    }
+}
+
+// Fills in what the current mode needs up front: the GEMM engine evaluates
+// the grids of all patches at once, the flatness modes subdivide every patch
+// so seams can be stitched, and the rate mode agrees on the border steps
+void planTessellation(int step, TessPlan& plan) {
+    plan.step = step;
+    if (patches.empty()) {
+        return;
+    }
+    if (ratePlanned()) {
+        buildRatePlan(plan.rates);
+    } else if (tessMode == TESS_UNIFORM && gridEngine == GRID_GEMM) {
+        plan.grids.resize((long)patches.size() * (step+1) * (step+1));
+        evalGridsGemm(patches, step, &plan.grids[0]);
+    } else if (tessMode == TESS_FLAT || tessMode == TESS_BUDGET) {
+        buildFlatPlan(plan.flat);
+    }
+}
+
+// Tessellates every patch into its own mesh on the thread pool. Depth first
+// adaptive patches are split further into one task per starting triangle,
+// unless the per patch triangle budget ties them together. Each task fills a
+// mesh of its own and those are joined in task order, so the result is the
+// same for any number of threads. Starting triangles share their edges, the
+// join merges their points by (u,v) so every point is a vertex once
+void tessellatePatches(TessPlan& plan, vector<Mesh>& meshes) {
+    if (tessMode == TESS_ADAPTIVE && adaptiveEngine == ADAPTIVE_WAVEFRONT) {
+        wavefrontTes(plan.step, meshes);
+        return;
+    }
+    bool perRoot = tessMode == TESS_ADAPTIVE && maxTriangles == 0;
+    int roots = perRoot ? 2 * plan.step * plan.step : 1;
+    vector<Mesh> parts((long)patches.size() * roots);
+    vector<vector<uint64_t> > keys(perRoot ? parts.size() : 0);
+    function<void(int)> task = [&](int t) {
+        VertexArraySink sink(parts[t]);
+        subdividepatch(t / roots, plan.step, sink, plan, perRoot ? t % roots : -1, perRoot ? &keys[t] : NULL);
+    };
+    threadPool().run(parts.size(), task);
+    
+    if (roots == 1) {
+        meshes.swap(parts);
+        return;
+    }
+    meshes.assign(patches.size(), Mesh());
+    for (int i = 0; i < patches.size(); i++) {
+        Mesh& mesh = meshes[i];
+        unordered_map<uint64_t, GLuint> merged;
+        vector<GLuint> remap;
+        for (int r = 0; r < roots; r++) {
+            const Mesh& part = parts[i*roots + r];
+            const vector<uint64_t>& partKeys = keys[i*roots + r];
+            remap.resize(part.vertices.size());
+            for (int v = 0; v < part.vertices.size(); v++) {
+                pair<unordered_map<uint64_t, GLuint>::iterator, bool> it = merged.insert(make_pair(partKeys[v], (GLuint)mesh.vertices.size()));
+                if (it.second) {
+                    mesh.vertices.push_back(part.vertices[v]);
+                }
+                remap[v] = it.first->second;
+            }
+            for (int k = 0; k < part.indices.size(); k++) {
+                mesh.indices.push_back(remap[part.indices[k]]);
+            }
+        }
+    }
+}
+
+// Time sliced flatness refinement for -f and -b. Every slice refines worst
+// first, then re-emits only the patches whose pieces or seams changed and
+// hands all meshes to publish, which returns false to stop early. The first
+// slice already has every patch, coarse. A slice refines for sliceTime ms, or
+// for as long as the last re-emit took if that was longer, so the re-emits
+// never take more than about half of the time
+float sliceTime = 0; // --slice, ms per slice, 0 tessellates in one go
+typedef function<bool(const vector<shared_ptr<const Mesh> >& meshes, bool done)> SliceCallback;
+
+void progressiveFlat(const SliceCallback& publish) {
+    FlatRefiner refiner(tessMode == TESS_BUDGET ? triangleBudget : 0);
+    FlatPlan plan;
+    vector<shared_ptr<const Mesh> > meshes(patches.size());
+    vector<int> emit;
+    function<void(int)> task = [&](int k) {
+        Mesh* mesh = new Mesh;
+        VertexArraySink sink(*mesh);
+        flatTes(emit[k], plan, sink);
+        meshes[emit[k]].reset(mesh);
+    };
+    
+    bool done = false;
+    chrono::steady_clock::duration slice = chrono::microseconds((long)(1000 * sliceTime));
+    chrono::steady_clock::duration emitted = chrono::steady_clock::duration::zero();
+    while (!done) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        done = refiner.refine(start + std::max(slice, emitted));
+        chrono::steady_clock::time_point refined = chrono::steady_clock::now();
+        vector<bool> dirty = refiner.touched;
+        refiner.collect(plan.leaves);
+        stitchFlatPlan(plan);
+        if (done && fitFlatBudget(refiner, plan)) {
+            dirty.assign(patches.size(), true);
+        }
+        
+        // split pieces can put new points on the seams of the neighbours
+        set<vector<float> > seams;
+        for (int i = 0; i < patches.size(); i++) {
+            for (int b = 0; dirty[i] && b < 4; b++) {
+                seams.insert(plan.keys[4*i + b]);
+            }
+        }
+        emit.clear();
+        for (int i = 0; i < patches.size(); i++) {
+            bool changed = dirty[i] || !meshes[i];
+            for (int b = 0; !changed && b < 4; b++) {
+                changed = seams.count(plan.keys[4*i + b]) > 0;
+            }
+            if (changed) {
+                emit.push_back(i);
+            }
+        }
+        threadPool().run(emit.size(), task);
+        emitted = chrono::steady_clock::now() - refined;
+        if (!publish(meshes, done)) {
+            return;
+        }
+    }
+}
+
+bool slicedMode() {
+    return sliceTime > 0 && (tessMode == TESS_FLAT || tessMode == TESS_BUDGET);
+}
+
+void tessellateAll(TriangleSink& sink) {
+    bezStep=stepSize();
+    if (slicedMode()) {
+        // the slices are only reported here, the sink gets the last one
+        int slices = 0;
+        vector<shared_ptr<const Mesh> > last;
+        progressiveFlat([&](const vector<shared_ptr<const Mesh> >& meshes, bool done) {
+            last = meshes;
+            if (progress) {
+                long triangles = 0;
+                for (int i = 0; i < meshes.size(); i++) {
+                    triangles += meshes[i]->triangleCount();
+                }
+                cout << "slice " << slices << ": " << triangles << " triangles" << endl;
+            }
+            slices++;
+            return true;
+        });
+        for (int i = 0; i < last.size(); i++) {
+            sink.indexed(*last[i]);
+        }
+        return;
+    }
+    TessPlan plan;
+    planTessellation(bezStep, plan);
+    vector<Mesh> meshes;
+    tessellatePatches(plan, meshes);
+    
+    //hand the patches over one after another, in order
+    for (int i = 0; i < meshes.size(); i++) {
+        sink.indexed(meshes[i]);
+    }
+}
+
+
+    
+
+
+
+//****************************************************
+// Background tessellation for the window. A worker
+// thread builds the meshes for the settings the display
+// asks for and publishes each finished set through an
+// atomically swapped pointer, the display keeps drawing
+// whichever set was published last
+//***************************************************
+
+// what the geometry depends on besides the patches, the view only in screen space
+class TessSettings {
+public:
+    float tolerance;
+    TessMode mode;
+    TessView view;
+    int levels; // tessellations per patch, each twice as coarse as the one before
+    TessSettings() : levels(1) {}
+    TessSettings(float tolerance, TessMode mode, const TessView& view = TessView()) : tolerance(tolerance), mode(mode), view(view), levels(1) {}
+    bool operator==(const TessSettings& other) const {
+        return tolerance == other.tolerance && mode == other.mode && view == other.view && levels == other.levels;
+    }
+    bool operator!=(const TessSettings& other) const { return !(*this == other); }
+};
+
+// settings scaled by a tolerance factor, uniform steps never below one
+TessSettings coarsened(const TessSettings& settings, float factor) {
+    float scaled = settings.tolerance * factor;
+    if (settings.mode == TESS_UNIFORM && settings.view.pixel <= 0) {
+        scaled = std::min(scaled, 1.0f);
+    }
+    return TessSettings(scaled, settings.mode, settings.view);
+}
+
+// a published tessellation, never changed again
+class TessResult {
+public:
+    TessSettings settings;
+    vector<shared_ptr<const Mesh> > meshes; // per level, one per patch, shared with later slices
+    bool complete; // false for the intermediate slices of a sliced job or levels of a chain
+    const Mesh* mesh(int level, int i) const { return meshes[level * patches.size() + i].get(); }
+};
+
+// While the window is up the worker owns tolerance, tessMode, tessView and bezStep, the
+// display only hands it new settings through request. The last few results
+// are kept, asking for one of those again publishes it without a job
+const int keptResults = 4;
+
+class TessWorker {
+public:
+    shared_ptr<const TessResult> current; // only through atomic_load/atomic_store
+    vector<shared_ptr<const TessResult> > kept; // most recently used last
+    TessSettings requested; // latest settings asked for
+    bool hasRequest, pending, running, stopping;
+    mutex lock;
+    condition_variable wake;
+    thread worker;
+    
+    TessWorker() : hasRequest(false), pending(false), running(false), stopping(false) {
+        worker = thread(&TessWorker::loop, this);
+    }
+    // A job still running is abandoned: the pool skips its remaining tasks
+    // and nothing of it is published
+    ~TessWorker() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        abandonJobs = true;
+        wake.notify_all();
+        worker.join();
+    }
+    
+    // asks for a tessellation at these settings unless it is already the
+    // latest one asked for. A kept one is published right away, otherwise a
+    // job is queued behind the one that is running
+    void request(const TessSettings& settings) {
+        {
+            lock_guard<mutex> guard(lock);
+            if (hasRequest && requested == settings) {
+                return;
+            }
+            requested = settings;
+            hasRequest = true;
+            int k = find(settings);
+            if (k >= 0) {
+                shared_ptr<const TessResult> result = kept[k];
+                kept.erase(kept.begin() + k);
+                kept.push_back(result);
+                atomic_store(&current, result);
+                pending = false;
+                return;
+            }
+            pending = true;
+        }
+        wake.notify_all();
+    }
+    
+    // index of the kept result for these settings, -1 if there is none. The
+    // caller holds the lock
+    int find(const TessSettings& settings) const {
+        for (int k = 0; k < kept.size(); k++) {
+            if (kept[k]->settings == settings) {
+                return k;
+            }
+        }
+        return -1;
+    }
+    
+    bool has(const TessSettings& settings) {
+        lock_guard<mutex> guard(lock);
+        return find(settings) >= 0;
+    }
+    
+    // true from a request until its result is published
+    bool busy() {
+        lock_guard<mutex> guard(lock);
+        return pending || running;
+    }
+    
+    // the last published tessellation, NULL until the first one is done
+    shared_ptr<const TessResult> latest() const {
+        return atomic_load(&current);
+    }
+    
+    void loop() {
+        while (true) {
+            TessSettings job;
+            {
+                unique_lock<mutex> guard(lock);
+                while (!stopping && !pending) {
+                    wake.wait(guard);
+                }
+                if (stopping) {
+                    return;
+                }
+                job = requested;
+                pending = false;
+                running = true;
+            }
+            tolerance = job.tolerance;
+            tessMode = job.mode;
+            tessView = job.view;
+            bezStep=stepSize();
+            if (job.levels > 1) {
+                chained(job);
+            } else if (slicedMode()) {
+                sliced(job);
+            } else {
+                TessPlan plan;
+                planTessellation(bezStep, plan);
+                vector<Mesh> meshes;
+                tessellatePatches(plan, meshes);
+                shared_ptr<TessResult> result(new TessResult);
+                result->settings = job;
+                result->complete = true;
+                for (int i = 0; i < meshes.size(); i++) {
+                    Mesh* mesh = new Mesh;
+                    mesh->swap(meshes[i]);
+                    result->meshes.push_back(shared_ptr<const Mesh>(mesh));
+                }
+                lock_guard<mutex> guard(lock);
+                if (!stopping) {
+                    publish(job, result);
+                }
+            }
+            lock_guard<mutex> guard(lock);
+            running = false;
+        }
+    }
+    
+    // A complete result is kept even when no longer wanted, and shown unless
+    // what is wanted has already been published from the kept ones. The
+    // caller holds the lock
+    void publish(const TessSettings& job, const shared_ptr<const TessResult>& result) {
+        if (result->complete) {
+            kept.push_back(result);
+            if (kept.size() > keptResults) {
+                kept.erase(kept.begin());
+            }
+        }
+        shared_ptr<const TessResult> shown = atomic_load(&current);
+        if (job == requested || !shown || shown->settings != requested) {
+            atomic_store(&current, result);
+        }
+    }
+    
+    // Tessellates the levels of a chain job coarsest first and publishes the
+    // levels done so far after each, stops once other settings are asked for
+    // or the worker is stopping
+    void chained(const TessSettings& job) {
+        int count = patches.size();
+        vector<shared_ptr<const Mesh> > meshes(job.levels * count);
+        for (int k = job.levels - 1; k >= 0; k--) {
+            tolerance = coarsened(job, ldexp(1.0f, k)).tolerance;
+            bezStep=stepSize();
+            TessPlan plan;
+            planTessellation(bezStep, plan);
+            vector<Mesh> level;
+            tessellatePatches(plan, level);
+            for (int i = 0; i < count; i++) {
+                Mesh* mesh = new Mesh;
+                mesh->swap(level[i]);
+                meshes[k*count + i].reset(mesh);
+            }
+            shared_ptr<TessResult> result(new TessResult);
+            result->settings = job;
+            result->meshes = meshes;
+            result->complete = k == 0;
+            lock_guard<mutex> guard(lock);
+            if (pending || stopping) {
+                return;
+            }
+            publish(job, result);
+        }
+    }
+    
+    // publishes every slice of a sliced job, stops once other settings are
+    // asked for or the worker is stopping
+    void sliced(const TessSettings& job) {
+        progressiveFlat([&](const vector<shared_ptr<const Mesh> >& meshes, bool done) {
+            shared_ptr<TessResult> result(new TessResult);
+            result->settings = job;
+            result->meshes = meshes;
+            result->complete = done;
+            lock_guard<mutex> guard(lock);
+            if (pending || stopping) {
+                return false;
+            }
+            publish(job, result);
+            return true;
+        });
+    }
+};
+
+// the worker, started on first use. The thread pool is started first so it
+// outlives the worker at exit
+TessWorker& tessWorker() {
+    threadPool();
+    static TessWorker worker;
+    return worker;
+}
+
+//****************************************************
+// Discrete LOD chain. With --lod-chain N the worker
+// tessellates every patch at N tolerances, each twice the
+// one before, and every frame draws each patch at the
+// level the distance of its bounding sphere calls for
+//***************************************************
+int chainLevels = 0; // --lod-chain, levels per patch, 1 or less draws the requested tolerance only
+float chainDistance = 11; // --lod-distance, level k is drawn from chainDistance * 2^k on
+const float chainHysteresis = 0.1f; // a patch keeps its level this fraction past either bound
+
+class PatchBounds {
+public:
+    vec3 centre;
+    float radius;
+};
+
+vector<PatchBounds> bounds; // per patch, around the control points and so the surface
+vector<int> chainLevel; // per patch, the level drawn last frame
+
+void boundPatches() {
+    bounds.resize(patches.size());
+    chainLevel.assign(patches.size(), 0);
+    for (int i = 0; i < patches.size(); i++) {
+        const Patch& patch = patches[i];
+        vec3 lo = patch.cp[0], hi = patch.cp[0];
+        for (int k = 1; k < 16; k++) {
+            lo = min(lo, patch.cp[k]);
+            hi = max(hi, patch.cp[k]);
+        }
+        bounds[i].centre = (lo + hi) / 2.0f;
+        bounds[i].radius = 0;
+        for (int k = 0; k < 16; k++) {
+            bounds[i].radius = std::max(bounds[i].radius, distance(patch.cp[k], bounds[i].centre));
+        }
+    }
+}
+
+// Picks the level of every patch for this frame. Level k is meant for
+// distances from chainDistance * 2^k to twice that, where its projected error
+// is no more than that of the finest level at chainDistance. A patch only
+// changes level once it is the hysteresis fraction outside its range
+void selectLevels(int levels) {
+    vec3 eye = unrotate(vec3(x - transX, 1 - transY, z));
+    for (int i = 0; i < patches.size(); i++) {
+        float d = std::max(0.0f, distance(eye, bounds[i].centre) - bounds[i].radius);
+        int& k = chainLevel[i];
+        k = std::min(k, levels - 1);
+        float inner = k > 0 ? chainDistance * ldexp(1.0f, k) * (1 - chainHysteresis) : 0;
+        float outer = chainDistance * ldexp(1.0f, k+1) * (1 + chainHysteresis);
+        if (d < inner || (d >= outer && k < levels - 1)) {
+            k = d < chainDistance ? 0 : std::min(levels - 1, (int)floor(log2(d / chainDistance)));
+        }
+    }
+}
+
+// the mesh of patch i at its selected level, or the next coarser one done
+const Mesh& chainMesh(const TessResult& result, int i) {
+    int k = chainLevel[i];
+    while (!result.mesh(k, i)) {
+        k++;
+    }
+    return *result.mesh(k, i);
+}
+
+// settings the display wants, set up in main
+TessSettings viewSettings;
+
+// viewSettings from the current camera, which only matters in screen space.
+// A chain already follows the distance, so in screen space its finest level
+// takes the pixel tolerance at chainDistance and the camera never causes a
+// tessellation
+TessSettings wantedSettings() {
+    if (chainLevels > 1) {
+        TessSettings settings(viewSettings.tolerance, viewSettings.mode, fixedDepthView(chainDistance));
+        settings.levels = chainLevels;
+        return settings;
+    }
+    return TessSettings(viewSettings.tolerance, viewSettings.mode, currentView());
+}
+
+//****************************************************
+// Redraw on change. A frame is only drawn when the
+// camera, the display mode or the published meshes
+// differ from what the last frame showed
+//***************************************************
+class DrawnState {
+public:
+    float angleX, angleY, transX, transY, z;
+    bool lines, smooth;
+    shared_ptr<const TessResult> result; // held so a new result can never reuse its address
+    bool operator==(const DrawnState& other) const {
+        return angleX == other.angleX && angleY == other.angleY && transX == other.transX
+            && transY == other.transY && z == other.z && lines == other.lines
+            && smooth == other.smooth && result == other.result;
+    }
+};
+
+DrawnState drawn; // what the last frame showed
+bool drawnValid = false;
+bool polling = false; // a pollWorker timer is pending
+const int pollInterval = 15; // ms between looks for new meshes while the worker is busy
+int fps = 0; // --fps, redraw at a fixed rate for benchmarking, 0 draws on change only
+
+DrawnState currentState() {
+    DrawnState state;
+    state.angleX = angleX;
+    state.angleY = angleY;
+    state.transX = transX;
+    state.transY = transY;
+    state.z = z;
+    state.lines = lines;
+    state.smooth = smooth;
+    state.result = tessWorker().latest();
+    return state;
+}
+
+void postIfChanged() {
+    if (!drawnValid || !(currentState() == drawn)) {
+        glutPostRedisplay();
+    }
+}
+
+// Looks for newly published meshes while the worker has a job. Whether it is
+// busy is read before looking, so a result published just before it goes idle
+// is still seen
+void pollWorker(int) {
+    bool busy = tessWorker().busy();
+    postIfChanged();
+    if (busy) {
+        glutTimerFunc(pollInterval, pollWorker, 0);
+    } else {
+        polling = false;
+    }
+}
+
+// fixed rate redraws for --fps, the achieved rate is reported every second
+long framesDrawn = 0;
+chrono::steady_clock::time_point framesSince;
+
+void frameTimer(int) {
+    glutPostRedisplay();
+    glutTimerFunc(1000 / fps, frameTimer, 0);
+}
+
+void countFrame() {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (framesDrawn++ == 0) {
+        framesSince = now;
+    }
+    double seconds = chrono::duration<double>(now - framesSince).count();
+    if (seconds >= 1) {
+        cout << (framesDrawn - 1) / seconds << " fps" << endl;
+        framesDrawn = 1;
+        framesSince = now;
+    }
+}
+
+//****************************************************
+// Interaction LOD. While the camera keys are in use the
+// display asks for a coarser tessellation, once input has
+// been idle for lodIdle ms it refines back to viewSettings,
+// halving the tolerance on every step
+//***************************************************
+float lodCoarse = 4; // --lod-coarse, tolerance factor while interacting, 1 or less turns it off
+int lodIdle = 300; // --lod-idle, ms without input before refining
+bool interacting = false;
+bool lodTimerArmed = false;
+chrono::steady_clock::time_point lastInteraction;
+
+void lodTimer(int) {
+    double idle = chrono::duration<double, milli>(chrono::steady_clock::now() - lastInteraction).count();
+    if (idle < lodIdle) {
+        glutTimerFunc(std::max(1, lodIdle - (int)idle), lodTimer, 0);
+        return;
+    }
+    lodTimerArmed = false;
+    interacting = false;
+    glutPostRedisplay();
+}
+
+// the camera keys call this on every press and repeat
+void interaction() {
+    if (lodCoarse <= 1) {
+        return;
+    }
+    lastInteraction = chrono::steady_clock::now();
+    interacting = true;
+    if (!lodTimerArmed) {
+        lodTimerArmed = true;
+        glutTimerFunc(lodIdle, lodTimer, 0);
+    }
+}
+
+// What the display asks the worker for. Refinement starts from what is on
+// screen unless the full tessellation is still kept from before. A chain has
+// its coarse levels ready, so it is never swapped out while interacting
+TessSettings lodSettings() {
+    TessSettings wanted = wantedSettings();
+    if (lodCoarse <= 1 || wanted.levels > 1) {
+        return wanted;
+    }
+    if (interacting) {
+        return coarsened(wanted, lodCoarse);
+    }
+    shared_ptr<const TessResult> shown = tessWorker().latest();
+    if (!shown || shown->settings.mode != wanted.mode
+        || shown->settings.tolerance <= wanted.tolerance || tessWorker().has(wanted)) {
+        return wanted;
+    }
+    return TessSettings(std::max(wanted.tolerance, shown->settings.tolerance / 2), wanted.mode, wanted.view);
+}
+
+// draws a cached mesh from its interleaved vertex array and index buffer,
+// the caller enables the client state
+void drawMesh(const Mesh& mesh) {
+    if (mesh.indices.empty()) {
+        return;
+    }
+    glVertexPointer(3, GL_FLOAT, sizeof(Vertex), &mesh.vertices[0].point);
+    glNormalPointer(GL_FLOAT, sizeof(Vertex), &mesh.vertices[0].normal);
+    glDrawElements(GL_TRIANGLES, mesh.indices.size(), GL_UNSIGNED_INT, &mesh.indices[0]);
+}
+
+//****************************************************
+// function that does the actual drawing of stuff
+//***************************************************
+void myDisplay(void) {
+    
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // Clear Color and Depth Buffers
+    glLoadIdentity ();     // make sure transformation is "zero'd"
+    
+    gluLookAt(x, 1.0f, z, x+lx, 1.0f,  z+lz, 0.0f, 1.0f,  0.0f);
+    
+    // Sets the material properties of the teapot
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, mcolor);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, specReflection);
+    glMateriali(GL_FRONT_AND_BACK, GL_SHININESS, 96);
+    
+    // Renders the patches using the points calculated via interpolation
+    if (smooth){
+        glShadeModel(GL_SMOOTH);
+    } else {
+        glShadeModel(GL_FLAT);
+    }
+    glPushMatrix();
+    glTranslatef(transX, transY, 0);
+    glRotatef(angleX, 1, 0, 0);
+    glRotatef(angleY, 0, 1, 0);
+    // wireframe is a polygon mode so toggling it never re-tessellates
+    if (lines){
+        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    } else {
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    }
+    // the previous meshes stay up until the worker publishes new ones,
+    // the poll timer brings those in once they are done
+    tessWorker().request(lodSettings());
+    if (!polling) {
+        polling = true;
+        glutTimerFunc(pollInterval, pollWorker, 0);
+    }
+    drawn = currentState();
+    drawnValid = true;
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    if (drawn.result && drawn.result->settings.levels > 1) {
+        selectLevels(drawn.result->settings.levels);
+        for (int i = 0; i < patches.size(); i++) {
+            drawMesh(chainMesh(*drawn.result, i));
+        }
+    } else {
+        for (int i = 0; drawn.result && i < drawn.result->meshes.size(); i++) {
+            drawMesh(*drawn.result->meshes[i]);
+        }
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glPopMatrix();
+
+    glFlush();
+    glutSwapBuffers();					// swap buffers (we earlier set double buffer)
+    if (fps > 0) {
+        countFrame();
+    }
+}
+
+// Parzer bezier files -- makes patch and curve objects from the file
+void parseFile(string file) {
+    bool init = false;
+    int lineNum = 0;
+    Patch patch;
+    
+    ifstream inpfile(file.c_str());
+    if(!inpfile.is_open()) {
+        cout << "Unable to open file" << endl;
+    } else {
+        string line;
+        while(inpfile.good()) {
+            vector<string> splitline;
+            string buf;
+            getline(inpfile,line);
+            stringstream ss(line);
+            while (ss >> buf) {
+                splitline.push_back(buf);
+            }
+            //Ignore blank lines
+            if(splitline.size() == 0) {
+                continue;
+            } else if (!init) {
+                bezStep = atoi(splitline[0].c_str()); //this isn't actually the step size, ignore it
+                patches.reserve(std::max(0, bezStep)); // it is the patch count, keep the store contiguous
+                lineNum = 1;
+                init = true;
+            } else {
+                vec3 p0(atof(splitline[0].c_str()),atof(splitline[1].c_str()),atof(splitline[2].c_str()));
+                vec3 p1(atof(splitline[3].c_str()),atof(splitline[4].c_str()),atof(splitline[5].c_str()));
+                vec3 p2(atof(splitline[6].c_str()),atof(splitline[7].c_str()),atof(splitline[8].c_str()));
+                vec3 p3(atof(splitline[9].c_str()),atof(splitline[10].c_str()),atof(splitline[11].c_str()));
+                
+                // Based on which line number is being parsed for the current patch
+                // the points become that row of the patch's control points
+                patch.cp[4*(lineNum-1)] = p0;
+                patch.cp[4*(lineNum-1)+1] = p1;
+                patch.cp[4*(lineNum-1)+2] = p2;
+                patch.cp[4*(lineNum-1)+3] = p3;
+                if (lineNum == 4) {
+                    patches.push_back(patch);
+                    lineNum = 1;
+                } else {
+                    lineNum++;
+                }
+            }
+        }
+        inpfile.close();
+    }
+}
+
+// Function that assigns zoom amount to +/-
+void processNormalKeys(unsigned char key, int x, int y) {
+    float fraction = 0.5f;
+	if (key == 32) {
+		exit(0);
+    } else if (key == 43) {
+        //x += lx * fraction; // remove global x, unneccessary 
+        z += lz * fraction;
+        interaction();
+    } else if (key == 45) {
+        //x -= lx * fraction;
+        z -= lz * fraction;
+        interaction();
+    } else if (key == 119){
+        lines=!lines;
+    } else if (key == 115){
+        smooth=!smooth;
+    }
+    postIfChanged();
+}
+
+// Function that assigns rotation and transformation to directional keys
+void processSpecialKeys(int key, int xx, int yy) {
+    
+	float fraction = 0.1f;
+    int mod = glutGetModifiers();
+    
+	switch (key) {
+		case GLUT_KEY_LEFT :
+            if (mod == GLUT_ACTIVE_SHIFT){
+                transX -= 0.5f;
+            } else {
+                angleY -= 5.0f;
+            }
+			break;
+		case GLUT_KEY_RIGHT :
+            if (mod == GLUT_ACTIVE_SHIFT){
+                transX += 0.5f;
+            } else {
+                angleY += 5.0f;
+			}
+            break;
+		case GLUT_KEY_UP :
+            if (mod == GLUT_ACTIVE_SHIFT){
+                transY += 0.5f;
+            } else {
+                angleX += 5.0f;
+            }
+			break;
+		case GLUT_KEY_DOWN :
+            if (mod == GLUT_ACTIVE_SHIFT){
+                transY -= 0.5f;
+            } else {
+                angleX -= 5.0f;
+            }
+			break;
+	}
+    interaction();
+    postIfChanged();
+}
+
+//****************************************************
+// tessellate without a GL context and write the mesh
+//***************************************************
+int runHeadless() {
+    NullSink counter;
+    PlyFileSink writer(outFile);
+    TriangleSink& sink = outFile.empty() ? (TriangleSink&)counter : (TriangleSink&)writer;
+    tessView = currentView(); // screen space sees the model as the window first shows it
+    
+    // wall time, the thread pool makes CPU time add up across cores
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    sink.begin();
+    tessellateAll(sink);
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    
+    long triangles = outFile.empty() ? counter.triangles : writer.buffer.triangleCount();
+    cout << patches.size() << " patches, " << triangles << " triangles in "
+         << chrono::duration<double, milli>(end - start).count() << " ms" << endl;
+    sink.end();
+    if (!outFile.empty() && !writer.ok) {
+        return 1;
+    }
+    return 0;
+}
+
+//****************************************************
+// drift check of every grid engine against the scalar
+// reference bezpatchinterp, up to step 256
+//***************************************************
+int runVerify() {
+    const GridEngine engines[] = { GRID_BATCH, GRID_SEPARABLE, GRID_FORWARD, GRID_TABLE, GRID_GEMM };
+    const char* names[] = { "batch", "separable", "forward", "table", "gemm" };
+    const int steps[] = { 1, 2, 3, 7, 16, 64, 100, 255, 256 };
+    const float posBound = 1e-5f; // relative to the size of the control net
+    const float normalBound = 1e-3f;
+    bool ok = true;
+    
+    for (int e = 0; e < sizeof(engines)/sizeof(engines[0]); e++) {
+        float maxPos = 0, maxNormal = 0;
+        for (int s = 0; s < sizeof(steps)/sizeof(steps[0]); s++) {
+            int row = steps[s] + 1;
+            vector<Vertex> ref(row*row), test(row*row);
+            for (int i = 0; i < patches.size(); i++) {
+                evalGridScalar(patches[i], steps[s], &ref[0]);
+                gridEngine = engines[e];
+                evalGrid(patches[i], steps[s], &test[0]);
+                
+                const Patch& patch = patches[i];
+                vec3 lo = patch.cp[0], hi = patch.cp[0];
+                for (int k = 1; k < 16; k++) {
+                    lo = min(lo, patch.cp[k]);
+                    hi = max(hi, patch.cp[k]);
+                }
+                float size = length(hi - lo);
+                for (int k = 0; k < row*row; k++) {
+                    maxPos = std::max(maxPos, length(ref[k].point - test[k].point) / size);
+                    // normals are ill conditioned where the surface degenerates, skip those
+                    vec3 point, dPdu, dPdv;
+                    bezpatchpartials(patch, gridParam(k % row, steps[s]), gridParam(k / row, steps[s]), point, dPdu, dPdv);
+                    if (length(cross(dPdu, dPdv)) > 1e-2f * size * size) {
+                        maxNormal = std::max(maxNormal, length(ref[k].normal - test[k].normal));
+                    }
+                }
+            }
+        }
+        bool pass = maxPos <= posBound && maxNormal <= normalBound;
+        ok = ok && pass;
+        cout << names[e] << ": max relative position error " << maxPos
+             << ", max normal error " << maxNormal << (pass ? " ok" : " FAILED") << endl;
+    }
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    // options start with "--", everything else is FILE STEPSIZE/TOLERANCE UNIFORM/ADAPTIVE/FLAT/BUDGET/PER PATCH
+    vector<char*> args;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i],"--headless")==0){
+            headless=true;
+        } else if (strcmp(argv[i],"--verify")==0){
+            verify=true;
+        } else if (strcmp(argv[i],"--out")==0 && i+1<argc){
+            outFile=argv[++i];
+        } else if (strcmp(argv[i],"--max-depth")==0 && i+1<argc){
+            maxDepth=std::min(depthLimit, std::max(0, atoi(argv[++i])));
+        } else if (strcmp(argv[i],"--max-tris")==0 && i+1<argc){
+            maxTriangles=atol(argv[++i]);
+        } else if (strcmp(argv[i],"--budget")==0 && i+1<argc){
+            triangleBudget=atol(argv[++i]);
+        } else if (strcmp(argv[i],"--time-budget")==0 && i+1<argc){
+            timeBudget=atof(argv[++i]);
+        } else if (strcmp(argv[i],"--threads")==0 && i+1<argc){
+            threadCount=std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i],"--adaptive")==0 && i+1<argc){
+            string name(argv[++i]);
+            if (name == "depth") {
+                adaptiveEngine = ADAPTIVE_DEPTH;
+            } else if (name == "wavefront") {
+                adaptiveEngine = ADAPTIVE_WAVEFRONT;
+            } else {
+                cout << "Unknown adaptive engine " << name << endl;
+            }
+        } else if (strcmp(argv[i],"--fps")==0 && i+1<argc){
+            fps=std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i],"--lod-coarse")==0 && i+1<argc){
+            lodCoarse=atof(argv[++i]);
+        } else if (strcmp(argv[i],"--lod-idle")==0 && i+1<argc){
+            lodIdle=std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i],"--slice")==0 && i+1<argc){
+            sliceTime=std::max(0.0, atof(argv[++i]));
+        } else if (strcmp(argv[i],"--lod-chain")==0 && i+1<argc){
+            chainLevels=std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i],"--lod-distance")==0 && i+1<argc){
+            chainDistance=std::max(0.001, atof(argv[++i]));
+        } else if (strcmp(argv[i],"--screen")==0){
+            screenSpace=true;
+        } else if (strcmp(argv[i],"--progress")==0){
+            progress=true;
+        } else if (strcmp(argv[i],"--grid")==0 && i+1<argc){
+            string name(argv[++i]);
+            if (name == "scalar") {
+                gridEngine = GRID_SCALAR;
+            } else if (name == "batch") {
+                gridEngine = GRID_BATCH;
+            } else if (name == "separable") {
+                gridEngine = GRID_SEPARABLE;
+            } else if (name == "forward") {
+                gridEngine = GRID_FORWARD;
+            } else if (name == "table") {
+                gridEngine = GRID_TABLE;
+            } else if (name == "gemm") {
+                gridEngine = GRID_GEMM;
+            } else {
+                cout << "Unknown grid engine " << name << endl;
+            }
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size()!=3){
+        printf("IMPROPER INPUTS: FILE, STEPSIZE/TOLERANCE, -u/-a/-f/-b/-p (UNIFORM/ADAPTIVE/FLATNESS/BUDGET/PER PATCH) [--headless] [--out FILE.ply] [--grid scalar|batch|separable|forward|table|gemm] [--verify]\n       [--max-depth N up to 400] [--max-tris N per patch, -a only]\n       [--budget TRIANGLES] [--time-budget MS] [--threads N]\n       [--adaptive depth|wavefront] [--progress] [--fps N]\n       [--lod-coarse FACTOR] [--lod-idle MS] [--slice MS, -f/-b only] [--screen]\n       [--lod-chain LEVELS] [--lod-distance D]\n");
+        exit(0);
+    }
+    string str(args[0]);
+    parseFile(str);
+    boundPatches();
+    if (strncmp(args[2],"-a",2)==0){
+        tessMode=TESS_ADAPTIVE;
+    } else if (strncmp(args[2],"-f",2)==0){
+        tessMode=TESS_FLAT;
+    } else if (strncmp(args[2],"-b",2)==0){
+        tessMode=TESS_BUDGET;
+    } else if (strncmp(args[2],"-p",2)==0){
+        tessMode=TESS_RATE;
+    } else {
+        tessMode=TESS_UNIFORM;
+    }
+    tolerance=atof(args[1]);
+    viewSettings = TessSettings(tolerance, tessMode);
+    if (sliceTime > 0 && !slicedMode()) {
+        cout << "--slice only applies to -f and -b, ignored" << endl;
+    }
+    
+    // Initalize theviewport size, screen space tolerances need it headless too
     viewport.w = 400;
     viewport.h = 400;
     
+    if (verify) {
+        return runVerify();
+    }
+    if (headless) {
+        return runHeadless();
+    }
+  
+    //This initializes glut
+    glutInit(&argc, argv);
+    
+    //This tells glut to use a double-buffered window with red, green, and blue channels
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+    
     //The size and position of the window
     glutInitWindowSize(viewport.w, viewport.h);
     glutInitWindowPosition(0,0);
@@ -590,7 +3154,10 @@ int main(int argc, char *argv[]) {
     
     glutDisplayFunc(myDisplay);				// function to run when its time to draw something
     glutReshapeFunc(myReshape);				// function to run when the window gets resized
-    glutIdleFunc(myDisplay);
+    // no idle function, frames are drawn when something changed or at --fps
+    if (fps > 0) {
+        glutTimerFunc(1000 / fps, frameTimer, 0);
+    }
     
     //Reads in keystrokes to either change view angle or exit
     glutKeyboardFunc(processNormalKeys);